@@ -0,0 +1,118 @@
+#ifndef __RE3_LIB_AST_H__
+#define __RE3_LIB_AST_H__
+
+#include <bitset>
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+#include "absl/types/span.h"
+
+namespace re3 {
+
+// A node of the abstract syntax tree of a regular expression.
+//
+// The `Parser` builds the tree and one of the automaton constructions turns it into a `TempNFA`
+// (see `BuildThompsonNFA` and `BuildGlushkovNFA`). Nodes are allocated and owned by an `AST`, and
+// refer to their children by plain pointers into the same `AST`. The list of children is allocated
+// from the memory resource of the `AST`.
+struct ASTNode {
+  enum class Kind {
+    // Matches only the empty string.
+    kEmpty,
+
+    // Matches any single character in `chars`. A class without characters matches nothing.
+    kCharacterClass,
+
+    // Matches the concatenations of the strings matched by `children`, in order.
+    kConcatenation,
+
+    // Matches the strings matched by any of `children`.
+    kAlternation,
+
+    // Matches the concatenations of `min` to `max` strings matched by the only child, or of at
+    // least `min` strings if `max` is negative.
+    kRepetition,
+  };
+
+  Kind kind = Kind::kEmpty;
+
+  // The characters of a `kCharacterClass` node.
+  std::bitset<256> chars;
+
+  // The bounds of a `kRepetition` node.
+  int min = 0;
+  int max = 0;
+
+  std::pmr::vector<ASTNode *> children;
+};
+
+// An abstract syntax tree, which owns all of its nodes.
+//
+// Nodes are allocated in chunks of geometrically increasing size and are never freed individually:
+// nodes that are dropped from the tree (e.g. by `SimplifyAST`) stay allocated until the whole
+// `AST` is destroyed. That makes building and rewriting the tree take few allocations, and
+// destroying it takes no recursion no matter how deep the tree is.
+//
+// The chunks and the lists of children are allocated from `resource`, which must outlive the `AST`.
+class AST {
+ public:
+  explicit AST(std::pmr::memory_resource *const resource = std::pmr::get_default_resource())
+      : resource_(resource), chunks_(resource) {}
+
+  AST(AST const &) = delete;
+  AST &operator=(AST const &) = delete;
+
+  ASTNode *root() const { return root_; }
+  void set_root(ASTNode *const root) { root_ = root; }
+
+  ASTNode *MakeEmpty() { return NewNode(ASTNode::Kind::kEmpty); }
+
+  ASTNode *MakeCharacterClass(std::bitset<256> const &chars) {
+    auto const node = NewNode(ASTNode::Kind::kCharacterClass);
+    node->chars = chars;
+    return node;
+  }
+
+  ASTNode *MakeConcatenation(absl::Span<ASTNode *const> const children) {
+    auto const node = NewNode(ASTNode::Kind::kConcatenation);
+    node->children.assign(children.begin(), children.end());
+    return node;
+  }
+
+  ASTNode *MakeAlternation(absl::Span<ASTNode *const> const children) {
+    auto const node = NewNode(ASTNode::Kind::kAlternation);
+    node->children.assign(children.begin(), children.end());
+    return node;
+  }
+
+  // REQUIRES: `min` must not be negative, and `max` must be either negative or at least `min`.
+  ASTNode *MakeRepetition(ASTNode *const child, int const min, int const max) {
+    auto const node = NewNode(ASTNode::Kind::kRepetition);
+    node->min = min;
+    node->max = max;
+    node->children.push_back(child);
+    return node;
+  }
+
+ private:
+  static inline size_t constexpr kMinChunkSize = 16;
+
+  ASTNode *NewNode(ASTNode::Kind const kind) {
+    // Chunks never grow past their reserved capacity, so the nodes never move.
+    if (chunks_.empty() || chunks_.back().size() == chunks_.back().capacity()) {
+      chunks_.emplace_back();
+      chunks_.back().reserve(kMinChunkSize << chunks_.size());
+    }
+    return &chunks_.back().emplace_back(
+        ASTNode{kind, {}, 0, 0, std::pmr::vector<ASTNode *>(resource_)});
+  }
+
+  std::pmr::memory_resource *resource_;
+  std::pmr::vector<std::pmr::vector<ASTNode>> chunks_;
+  ASTNode *root_ = nullptr;
+};
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_AST_H__
@@ -1,20 +1,68 @@
 #ifndef __RE3_LIB_AUTOMATON_H__
 #define __RE3_LIB_AUTOMATON_H__
 
+#include <climits>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <string_view>
+#include <vector>
 
 namespace re3 {
 
+// Which of the prefixes accepted by an automaton `AutomatonInterface::MatchPrefix` looks for.
+enum class PrefixLength {
+  // The shortest one. The run stops as soon as the automaton enters an accepting state.
+  kShortest,
+
+  // The longest one. The run goes on until the end of the input or until the automaton can't reach
+  // an accepting state anymore.
+  kLongest,
+};
+
 class AutomatonInterface {
  public:
   virtual ~AutomatonInterface() = default;
 
   virtual std::unique_ptr<AutomatonInterface> Clone() const = 0;
 
+  // Returns true iff the automaton accepts the whole `input`.
   virtual bool Run(std::string_view input) const = 0;
+
+  // Returns the length of the shortest or longest prefix of `input` accepted by the automaton, or
+  // `std::nullopt` if it doesn't accept any. The empty prefix counts, in which case the result is
+  // 0.
+  virtual std::optional<size_t> MatchPrefix(std::string_view input, PrefixLength length) const = 0;
+
+  // Like `MatchPrefix`, but reads `input` backwards starting from its last character, and returns
+  // the length of the shortest or longest suffix whose reversal is accepted. For automata built
+  // from a reversed pattern (see `TempNFA::Reverse`) that's a suffix matching the pattern itself.
+  virtual std::optional<size_t> MatchSuffix(std::string_view input, PrefixLength length) const = 0;
+
+  // Returns the number of bytes held by the automaton: the object itself, its tables, and any
+  // caches and scratch space it keeps between runs.
+  virtual size_t GetMemoryUsage() const = 0;
 };
 
+// Returns the `i`-th character of `input`, counting from the end if `kReverse` is true. Lets the
+// implementations of `MatchPrefix` and `MatchSuffix` share their code.
+template <bool kReverse>
+uint8_t GetCharacter(std::string_view const input, size_t const i) {
+  return kReverse ? input[input.size() - 1 - i] : input[i];
+}
+
+// Returns the number of bytes allocated by `vector`, for the implementations of `GetMemoryUsage`.
+template <typename Value, typename Allocator>
+size_t GetAllocatedBytes(std::vector<Value, Allocator> const &vector) {
+  return vector.capacity() * sizeof(Value);
+}
+
+template <typename Allocator>
+size_t GetAllocatedBytes(std::vector<bool, Allocator> const &vector) {
+  return (vector.capacity() + CHAR_BIT - 1) / CHAR_BIT;
+}
+
 }  // namespace re3
 
 #endif  // __RE3_LIB_AUTOMATON_H__
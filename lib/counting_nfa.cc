@@ -0,0 +1,178 @@
+#include "lib/counting_nfa.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "lib/automaton.h"
+#include "lib/counting_set.h"
+#include "lib/nfa.h"
+#include "lib/sparse_set.h"
+
+namespace re3 {
+
+CountingNFA::CountingNFA(NFA nfa, absl::Span<Counter const> const counters)
+    : nfa_(std::move(nfa)),
+      counters_(counters.begin(), counters.end(), nfa_.resource()),
+      counter_chars_(counters_.size(), nfa_.resource()),
+      counting_states_(nfa_.num_states(), false, nfa_.resource()) {
+  for (size_t i = 0; i < counters_.size(); ++i) {
+    counting_states_[counters_[i].state] = true;
+    for (auto const &edge : nfa_.edges(counters_[i].state)) {
+      for (int ch = edge.first; ch <= edge.last; ++ch) {
+        counter_chars_[i].set(ch);
+      }
+    }
+  }
+}
+
+CountingNFA::CountingNFA(CountingNFA &&other) noexcept
+    : nfa_(std::move(other.nfa_)),
+      counters_(std::move(other.counters_)),
+      counter_chars_(std::move(other.counter_chars_)),
+      counting_states_(std::move(other.counting_states_)) {}
+
+CountingNFA &CountingNFA::operator=(CountingNFA &&other) noexcept {
+  nfa_ = std::move(other.nfa_);
+  counters_ = std::move(other.counters_);
+  counter_chars_ = std::move(other.counter_chars_);
+  counting_states_ = std::move(other.counting_states_);
+  absl::MutexLock lock(&mutex_);
+  scratch_pool_.clear();
+  return *this;
+}
+
+std::unique_ptr<AutomatonInterface> CountingNFA::Clone() const {
+  return std::make_unique<CountingNFA>(*this);
+}
+
+bool CountingNFA::Run(std::string_view const input) const {
+  auto scratch = AcquireScratch();
+  Start(scratch.get());
+  SparseSet *states = &scratch->states;
+  SparseSet *next_states = &scratch->next_states;
+  for (uint8_t const ch : input) {
+    if (states->empty()) {
+      break;
+    }
+    Step(scratch.get(), *states, ch, next_states);
+    std::swap(states, next_states);
+  }
+  bool const result = states->Contains(nfa_.final_state());
+  ReleaseScratch(std::move(scratch));
+  return result;
+}
+
+std::optional<size_t> CountingNFA::MatchPrefix(std::string_view const input,
+                                               PrefixLength const length) const {
+  return MatchImpl<false>(input, length);
+}
+
+std::optional<size_t> CountingNFA::MatchSuffix(std::string_view const input,
+                                               PrefixLength const length) const {
+  return MatchImpl<true>(input, length);
+}
+
+template <bool kReverse>
+std::optional<size_t> CountingNFA::MatchImpl(std::string_view const input,
+                                             PrefixLength const length) const {
+  auto scratch = AcquireScratch();
+  Start(scratch.get());
+  SparseSet *states = &scratch->states;
+  SparseSet *next_states = &scratch->next_states;
+  std::optional<size_t> result;
+  for (size_t i = 0; !states->empty(); ++i) {
+    if (states->Contains(nfa_.final_state())) {
+      result = i;
+      if (length == PrefixLength::kShortest) {
+        break;
+      }
+    }
+    if (i == input.size()) {
+      break;
+    }
+    Step(scratch.get(), *states, GetCharacter<kReverse>(input, i), next_states);
+    std::swap(states, next_states);
+  }
+  ReleaseScratch(std::move(scratch));
+  return result;
+}
+
+size_t CountingNFA::GetMemoryUsage() const {
+  size_t bytes = sizeof(CountingNFA) - sizeof(NFA) + nfa_.GetMemoryUsage() +
+                 GetAllocatedBytes(counters_) + GetAllocatedBytes(counter_chars_) +
+                 GetAllocatedBytes(counting_states_);
+  absl::MutexLock lock(&mutex_);
+  bytes += GetAllocatedBytes(scratch_pool_);
+  for (auto const &scratch : scratch_pool_) {
+    // The storage of the counting sets isn't exposed, only their objects are counted. They're
+    // cleared when the scratch is released, so they hold little else.
+    bytes += sizeof(Scratch) + scratch->states.GetAllocatedBytes() +
+             scratch->next_states.GetAllocatedBytes() + GetAllocatedBytes(scratch->counting_sets);
+  }
+  return bytes;
+}
+
+std::unique_ptr<CountingNFA::Scratch> CountingNFA::AcquireScratch() const {
+  absl::MutexLock lock(&mutex_);
+  if (scratch_pool_.empty()) {
+    return std::make_unique<Scratch>(nfa_.num_states(), counters_);
+  }
+  auto scratch = std::move(scratch_pool_.back());
+  scratch_pool_.pop_back();
+  return scratch;
+}
+
+void CountingNFA::ReleaseScratch(std::unique_ptr<Scratch> scratch) const {
+  scratch->states.Clear();
+  scratch->next_states.Clear();
+  for (auto &counting_set : scratch->counting_sets) {
+    counting_set.Clear();
+  }
+  absl::MutexLock lock(&mutex_);
+  scratch_pool_.push_back(std::move(scratch));
+}
+
+void CountingNFA::Start(Scratch *const scratch) const {
+  for (auto const state : nfa_.EpsilonClosure(nfa_.initial_state())) {
+    scratch->states.Insert(state);
+  }
+}
+
+void CountingNFA::Step(Scratch *const scratch, SparseSet const &states, uint8_t const ch,
+                       SparseSet *const next_states) const {
+  next_states->Clear();
+  for (auto const state : states) {
+    if (!counting_states_[state]) {
+      nfa_.Step(absl::MakeConstSpan(&state, 1), ch, next_states);
+    }
+  }
+  for (size_t i = 0; i < counters_.size(); ++i) {
+    auto const &counter = counters_[i];
+    auto &counting_set = scratch->counting_sets[i];
+    if (counter_chars_[i][ch]) {
+      counting_set.Increment();
+    } else {
+      counting_set.Clear();
+    }
+    // The counting state is in `next_states` at this point iff it was just entered.
+    if (next_states->Contains(counter.state)) {
+      counting_set.InsertOne();
+    } else if (!counting_set.empty()) {
+      next_states->Insert(counter.state);
+    }
+    if (counting_set.CanExit()) {
+      for (auto const state : nfa_.EpsilonClosure(counter.exit_state)) {
+        next_states->Insert(state);
+      }
+    }
+  }
+}
+
+}  // namespace re3
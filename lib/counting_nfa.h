@@ -0,0 +1,119 @@
+#ifndef __RE3_LIB_COUNTING_NFA_H__
+#define __RE3_LIB_COUNTING_NFA_H__
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "lib/automaton.h"
+#include "lib/counting_set.h"
+#include "lib/nfa.h"
+#include "lib/sparse_set.h"
+
+namespace re3 {
+
+// An `NFA` augmented with counters, which represent bounded repetitions of a character class (e.g.
+// `.{0,1000}` or `[0-9a-f]{32,512}`) with a single state rather than one state per repetition.
+//
+// Every counter is attached to a counting state whose only edges loop back to itself and are
+// labeled with the repeated class. Entering the counting state from another state starts a new
+// count at 1, and taking the loop increments all the counts started so far. Once a count is within
+// the bounds of the repetition the automaton can also move to the exit state of the counter through
+// an epsilon-move. The live counts of every counter are tracked by a `CountingSet`, so the size of
+// the automaton and the time it takes to process a character don't depend on the bounds.
+//
+// The tables are allocated from the same memory resource as those of the `NFA`.
+class CountingNFA final : public AutomatonInterface {
+ public:
+  struct Counter {
+    // The counting state. Its edges are all loops labeled with the repeated class.
+    int32_t state;
+
+    // The bounds of the repetition. A negative `max` means it's unbounded. `min` is at least 1.
+    int min;
+    int max;
+
+    // The state entered when the repetition ends.
+    int32_t exit_state;
+  };
+
+  explicit CountingNFA(NFA nfa, absl::Span<Counter const> counters);
+
+  // Copies don't share the scratch space of the original.
+  CountingNFA(CountingNFA const &other) : CountingNFA(other.nfa_, other.counters_) {}
+
+  CountingNFA &operator=(CountingNFA const &other) { return *this = CountingNFA(other); }
+
+  CountingNFA(CountingNFA &&other) noexcept;
+  CountingNFA &operator=(CountingNFA &&other) noexcept;
+
+  size_t num_counters() const { return counters_.size(); }
+
+  std::unique_ptr<AutomatonInterface> Clone() const override;
+
+  bool Run(std::string_view input) const override;
+
+  std::optional<size_t> MatchPrefix(std::string_view input, PrefixLength length) const override;
+
+  std::optional<size_t> MatchSuffix(std::string_view input, PrefixLength length) const override;
+
+  size_t GetMemoryUsage() const override;
+
+ private:
+  // The state sets and counting sets used by a single run.
+  struct Scratch {
+    explicit Scratch(size_t const num_states, absl::Span<Counter const> const counters)
+        : states(num_states), next_states(num_states) {
+      counting_sets.reserve(counters.size());
+      for (auto const &counter : counters) {
+        counting_sets.emplace_back(counter.min, counter.max);
+      }
+    }
+
+    SparseSet states;
+    SparseSet next_states;
+    std::vector<CountingSet> counting_sets;
+  };
+
+  // Takes a scratch from the pool, or allocates a new one if the pool is empty.
+  std::unique_ptr<Scratch> AcquireScratch() const;
+
+  // Returns a scratch to the pool.
+  void ReleaseScratch(std::unique_ptr<Scratch> scratch) const;
+
+  // Shared implementation of `MatchPrefix` and `MatchSuffix`.
+  template <bool kReverse>
+  std::optional<size_t> MatchImpl(std::string_view input, PrefixLength length) const;
+
+  // Inserts the initial state and its epsilon-closure in `scratch->states`.
+  void Start(Scratch *scratch) const;
+
+  // Reads `ch` from the states in `states` and the counting sets of `scratch`, storing the states
+  // reached in `next_states` and updating the counting sets.
+  void Step(Scratch *scratch, SparseSet const &states, uint8_t ch, SparseSet *next_states) const;
+
+  NFA nfa_;
+  std::pmr::vector<Counter> counters_;
+
+  // The characters of the repeated class of every counter.
+  std::pmr::vector<std::bitset<256>> counter_chars_;
+
+  // Flags the counting states, whose loops are taken by the counters rather than by the `NFA`.
+  std::pmr::vector<bool> counting_states_;
+
+  mutable absl::Mutex mutex_;
+  mutable std::vector<std::unique_ptr<Scratch>> scratch_pool_ ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_COUNTING_NFA_H__
@@ -0,0 +1,87 @@
+#ifndef __RE3_LIB_COUNTING_SET_H__
+#define __RE3_LIB_COUNTING_SET_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+
+namespace re3 {
+
+// The set of values of a repetition counter that are live at the same time, for the counting-set
+// automata described by Turoňová et al. in "Regex Matching with Counting-Set Automata". All values
+// are incremented at once when the counted character class matches.
+//
+// Every value is stored as the tick of a clock at which it was inserted with value 1, so
+// incrementing all values only takes advancing the clock. Insertion ticks are kept as runs of
+// consecutive ticks, oldest first. Values greater than `max` are dropped as they expire, and of the
+// values that reached `min` only the smallest one is kept because the others can't make a
+// difference: they are all past the minimum and they expire earlier. So the set never holds more
+// than one run for every value below `min`, and all operations take amortized constant time
+// regardless of the bounds.
+class CountingSet {
+ public:
+  // A negative `max` means the counter is unbounded.
+  //
+  // REQUIRES: `min` must be at least 1, and `max` must be either negative or at least `min`.
+  explicit CountingSet(int const min, int const max) : min_(min), max_(max) {}
+
+  CountingSet(CountingSet const &) = default;
+  CountingSet &operator=(CountingSet const &) = default;
+  CountingSet(CountingSet &&) noexcept = default;
+  CountingSet &operator=(CountingSet &&) noexcept = default;
+
+  bool empty() const { return runs_.empty(); }
+
+  void Clear() { runs_.clear(); }
+
+  // Increments all values, dropping those that exceed the maximum.
+  void Increment() {
+    ++clock_;
+    if (max_ >= 0) {
+      int64_t const oldest = clock_ - max_ + 1;
+      while (!runs_.empty() && runs_.front().last < oldest) {
+        runs_.pop_front();
+      }
+      if (!runs_.empty()) {
+        runs_.front().first = std::max(runs_.front().first, oldest);
+      }
+    }
+    // Values inserted at or before `threshold` have reached the minimum, only keep the latest one.
+    int64_t const threshold = clock_ - min_ + 1;
+    while (runs_.size() > 1 && runs_[1].first <= threshold) {
+      runs_.pop_front();
+    }
+    if (!runs_.empty()) {
+      auto &front = runs_.front();
+      front.first = std::max(front.first, std::min(front.last, threshold));
+    }
+  }
+
+  // Inserts the value 1.
+  void InsertOne() {
+    if (!runs_.empty() && runs_.back().last >= clock_ - 1) {
+      runs_.back().last = clock_;
+    } else {
+      runs_.push_back({clock_, clock_});
+    }
+  }
+
+  // Checks whether any value is within the bounds, in which case the repetition can end.
+  bool CanExit() const { return !runs_.empty() && runs_.front().first <= clock_ - min_ + 1; }
+
+ private:
+  // The values inserted at ticks `first` to `last`, inclusive.
+  struct Run {
+    int64_t first;
+    int64_t last;
+  };
+
+  int min_;
+  int max_;
+  int64_t clock_ = 0;
+  std::deque<Run> runs_;
+};
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_COUNTING_SET_H__
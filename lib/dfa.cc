@@ -1,35 +1,201 @@
 #include "lib/dfa.h"
 
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <string_view>
 
+#include "lib/automaton.h"
+#include "lib/prefilter.h"
+
 namespace re3 {
 
-std::unique_ptr<AutomatonInterface> DFA::Clone() const { return std::make_unique<DFA>(*this); }
+template <typename StateId>
+std::unique_ptr<AutomatonInterface> DFA<StateId>::Clone() const {
+  return std::make_unique<DFA>(*this);
+}
+
+template <typename StateId>
+bool DFA<StateId>::Run(std::string_view const input) const {
+  if (!pair_states_.empty()) {
+    return IsAccepting(RunPairs(input));
+  }
+  StateId const *const states = states_.data();
+  uint8_t const *const byte_classes = byte_classes_.data();
+  auto it = reinterpret_cast<uint8_t const *>(input.data());
+  auto const end = it + input.size();
+  uint32_t state = initial_state_;
+  if (state >= special_states_limit_) {
+    while (end - it >= kUnrollFactor) {
+      state = states[state + byte_classes[it[0]]];
+      state = states[state + byte_classes[it[1]]];
+      state = states[state + byte_classes[it[2]]];
+      state = states[state + byte_classes[it[3]]];
+      it += kUnrollFactor;
+      if (state < special_states_limit_) {
+        break;
+      }
+    }
+    while (it < end && state >= special_states_limit_) {
+      state = states[state + byte_classes[*it++]];
+    }
+  }
+  return IsAccepting(state);
+}
 
-bool DFA::Run(std::string_view input) const {
-  int32_t state = initial_state_;
-  while (!input.empty()) {
-    auto const epsilon_transition = states_[state][0];
-    if (epsilon_transition < 0) {
-      uint8_t const ch = input[0];
-      auto const transition = states_[state][ch];
-      if (transition < 0) {
-        return false;
+template <typename StateId>
+uint32_t DFA<StateId>::RunPairs(std::string_view const input) const {
+  uint32_t const *const pair_states = pair_states_.data();
+  uint8_t const *const byte_classes = byte_classes_.data();
+  uint32_t const num_classes = num_classes_;
+  uint32_t const row_size = num_classes * num_classes;
+  // The special states have the lowest rows in both tables.
+  uint32_t const special_states_limit = special_states_limit_ / num_classes * row_size;
+  auto it = reinterpret_cast<uint8_t const *>(input.data());
+  auto const end = it + input.size();
+  auto const pair = [&](uint8_t const *const chars) {
+    return byte_classes[chars[0]] * num_classes + byte_classes[chars[1]];
+  };
+  uint32_t state = initial_state_ / num_classes * row_size;
+  if (state >= special_states_limit) {
+    // The classes of the pairs don't depend on the state, so the only dependent loads are those of
+    // the transitions.
+    while (end - it >= 2 * kUnrollFactor) {
+      state = pair_states[state + pair(it)];
+      state = pair_states[state + pair(it + 2)];
+      state = pair_states[state + pair(it + 4)];
+      state = pair_states[state + pair(it + 6)];
+      it += 2 * kUnrollFactor;
+      if (state < special_states_limit) {
+        break;
+      }
+    }
+  }
+  // Finish with the other table, which also takes care of an odd character.
+  StateId const *const states = states_.data();
+  state = state / row_size * num_classes;
+  while (it < end && state >= special_states_limit_) {
+    state = states[state + byte_classes[*it++]];
+  }
+  return state;
+}
+
+template <typename StateId>
+template <bool kReverse>
+std::optional<size_t> DFA<StateId>::MatchImpl(std::string_view const input,
+                                              PrefixLength const length) const {
+  StateId const *const states = states_.data();
+  uint8_t const *const byte_classes = byte_classes_.data();
+  auto const next = [&](uint32_t const state, size_t const i) -> uint32_t {
+    return states[state + byte_classes[GetCharacter<kReverse>(input, i)]];
+  };
+  size_t i = 0;
+  uint32_t state = initial_state_;
+  // The state from which the prefilter skips ahead. Backward scans don't use the prefilter, in
+  // which case no state matches.
+  uint32_t const prefilter_state = kReverse || prefilter_.empty()
+                                       ? std::numeric_limits<uint32_t>::max()
+                                       : uint32_t{initial_state_};
+  std::optional<size_t> result;
+  while (true) {
+    if (state == prefilter_state) {
+      // The initial state loops on every byte the prefilter skips, and it isn't accepting.
+      i = prefilter_.FindCandidate(input, i);
+      if (i == std::string_view::npos) {
+        return result;
+      }
+    }
+    // Skip over non-accepting states a few characters at a time. If any of the skipped states is
+    // special or accepting the characters are read again one by one.
+    while (state >= accepting_states_limit_ && input.size() - i >= kUnrollFactor) {
+      uint32_t const state1 = next(state, i);
+      uint32_t const state2 = next(state1, i + 1);
+      uint32_t const state3 = next(state2, i + 2);
+      uint32_t const state4 = next(state3, i + 3);
+      if (std::min({state1, state2, state3, state4}) < accepting_states_limit_) {
+        break;
+      }
+      state = state4;
+      i += kUnrollFactor;
+      if (state == prefilter_state) {
+        break;
+      }
+    }
+    if (state < special_states_limit_) {
+      if (state == kDeadState) {
+        return result;
+      }
+      // The match state accepts every continuation.
+      return length == PrefixLength::kShortest ? i : input.size();
+    }
+    if (state < accepting_states_limit_) {
+      result = i;
+      if (length == PrefixLength::kShortest) {
+        return result;
       }
-      state = transition;
-      input.remove_prefix(1);
-    } else {
-      state = epsilon_transition;
     }
+    if (i == input.size()) {
+      return result;
+    }
+    state = next(state, i++);
+  }
+}
+
+template <typename StateId>
+Prefilter DFA<StateId>::MakeInitialStatePrefilter() const {
+  if (initial_state_ < accepting_states_limit_) {
+    return Prefilter();
+  }
+  std::bitset<256> exit_bytes;
+  for (int ch = 0; ch < 256; ++ch) {
+    exit_bytes[ch] = states_[initial_state_ + byte_classes_[ch]] != initial_state_;
   }
-  while (state != final_state_) {
-    state = states_[state][0];
-    if (state < 0) {
-      return false;
+  return Prefilter("", exit_bytes);
+}
+
+template <typename StateId>
+std::pmr::vector<uint32_t> DFA<StateId>::MakePairStates() const {
+  std::pmr::vector<uint32_t> pair_states(states_.get_allocator());
+  size_t const num_rows = states_.size() / num_classes_;
+  size_t const row_size = num_classes_ * num_classes_;
+  if (num_rows * row_size * sizeof(uint32_t) > kMaxPairTableBytes) {
+    return pair_states;
+  }
+  pair_states.reserve(num_rows * row_size);
+  for (size_t row = 0; row < num_rows; ++row) {
+    for (int c1 = 0; c1 < num_classes_; ++c1) {
+      uint32_t const state = states_[row * num_classes_ + c1];
+      for (int c2 = 0; c2 < num_classes_; ++c2) {
+        pair_states.push_back(states_[state + c2] / num_classes_ * row_size);
+      }
     }
   }
-  return true;
+  return pair_states;
 }
 
+template <typename StateId>
+std::optional<size_t> DFA<StateId>::MatchPrefix(std::string_view const input,
+                                                PrefixLength const length) const {
+  return MatchImpl<false>(input, length);
+}
+
+template <typename StateId>
+std::optional<size_t> DFA<StateId>::MatchSuffix(std::string_view const input,
+                                                PrefixLength const length) const {
+  return MatchImpl<true>(input, length);
+}
+
+template <typename StateId>
+size_t DFA<StateId>::GetMemoryUsage() const {
+  return sizeof(DFA) + GetAllocatedBytes(states_) + GetAllocatedBytes(pair_states_);
+}
+
+template class DFA<uint8_t>;
+template class DFA<uint16_t>;
+template class DFA<uint32_t>;
+
 }  // namespace re3
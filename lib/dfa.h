@@ -2,48 +2,159 @@
 #define __RE3_LIB_DFA_H__
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "lib/automaton.h"
+#include "lib/prefilter.h"
 
 namespace re3 {
 
+// Maps every input character to its equivalence class. Two characters are equivalent if they always
+// lead to the same state, so transition tables only need one column per class.
+using ByteClasses = std::array<uint8_t, 256>;
+
 // Represents a deterministic finite automaton (DFA).
 //
 // This class is faster than `NFA` and is used to run all regular expressions that compile into a
 // deterministic automaton (this is not possible for all expressions, some will necessarily yield a
 // non-deterministic one).
+//
+// `DFA` objects are generated from a `TempDFA` and use a representation optimized for `Run`:
+//
+//  * states are identified by the offset of their row in the transition table (that is, the state
+//    number premultiplied by the number of byte classes), so that looking up a transition takes a
+//    single addition;
+//  * missing transitions lead to a dead state rather than being marked by a negative value, so the
+//    inner loop doesn't need to check every transition;
+//  * the dead state and the "match state" (an accepting state whose transitions all lead back to
+//    itself, e.g. after a trailing `.*`) get the lowest ids, so a single comparison detects that
+//    the outcome of the run is already known;
+//  * the other accepting states come right after them, so another comparison tells whether a state
+//    is accepting without looking up a separate table;
+//  * if the table is small, `Run` also uses a second one indexed by pairs of byte classes, so that
+//    it takes one transition every two input characters and the chain of dependent loads that
+//    bounds its speed is half as long;
+//  * if the initial state isn't accepting and loops on all but a few bytes, as in unanchored
+//    automata (see `TempNFA::AllowAnyPrefix`), `MatchPrefix` uses a `Prefilter` to skip ahead to
+//    the next of those bytes whenever it's back in the initial state.
+//
+// `StateId` is the type of the transitions. `TempDFA` picks the narrowest of `uint8_t`, `uint16_t`
+// and `uint32_t` that can hold the offset of every row, so that the tables of small automata are
+// more likely to stay in cache.
+template <typename StateId>
 class DFA final : public AutomatonInterface {
  public:
-  // `State` is represented by an array of 256 edges, one for every possible input character. Each
-  // edge is an integer representing the next state, or a negative value if that edge doesn't exist.
-  using State = std::array<int32_t, 256>;
-  using States = std::vector<State>;
+  static_assert(std::is_unsigned_v<StateId> && sizeof(StateId) <= sizeof(uint32_t));
+
+  // The transition table has one row per state and one column per byte class. Each transition is
+  // the offset of the row of the next state. Row 0 belongs to the dead state.
+  using States = std::pmr::vector<StateId>;
+
+  // The id of the dead state.
+  static inline StateId constexpr kDeadState = 0;
+
+  // Number of transitions taken by every iteration of the unrolled loops in `Run` and
+  // `MatchPrefix`. `Run` checks special states only once per iteration, which is fine because they
+  // loop on themselves.
+  static inline int constexpr kUnrollFactor = 4;
+
+  // Maximum size of the table of transitions on pairs of byte classes used by `Run`. Larger tables
+  // would push the other one out of the L1 cache and gain little.
+  static inline size_t constexpr kMaxPairTableBytes = size_t{1} << 15;
 
   explicit DFA() = default;
 
-  explicit DFA(States states, int32_t const initial_state, int32_t const final_state)
-      : states_(std::move(states)), initial_state_(initial_state), final_state_(final_state) {}
+  // `special_states` is the number of rows at the beginning of the table that belong to special
+  // states: only the dead state or the dead state and the match state, in this order. All
+  // transitions of the match state must lead back to itself. The rows of the other accepting states
+  // follow, up to row `accepting_states_end` (excluded), and the rows of the non-accepting states
+  // come last. The table keeps the memory resource it was allocated from.
+  explicit DFA(ByteClasses const &byte_classes, int const num_classes, States states,
+               StateId const initial_state, int const special_states,
+               int const accepting_states_end)
+      : byte_classes_(byte_classes),
+        num_classes_(num_classes),
+        states_(std::move(states)),
+        initial_state_(initial_state),
+        special_states_limit_(special_states * num_classes),
+        accepting_states_limit_(accepting_states_end * num_classes),
+        prefilter_(MakeInitialStatePrefilter()),
+        pair_states_(MakePairStates()) {}
+
+  // Copies allocate their tables from the same memory resource as the original.
+  DFA(DFA const &other)
+      : byte_classes_(other.byte_classes_),
+        num_classes_(other.num_classes_),
+        states_(other.states_, other.states_.get_allocator()),
+        initial_state_(other.initial_state_),
+        special_states_limit_(other.special_states_limit_),
+        accepting_states_limit_(other.accepting_states_limit_),
+        prefilter_(other.prefilter_),
+        pair_states_(other.pair_states_, other.pair_states_.get_allocator()) {}
 
-  DFA(DFA const &) = default;
   DFA &operator=(DFA const &) = default;
   DFA(DFA &&) noexcept = default;
   DFA &operator=(DFA &&) noexcept = default;
 
+  // Returns the number of states of the automaton, not counting the dead state.
+  size_t num_states() const { return states_.size() / num_classes_ - 1; }
+
   std::unique_ptr<AutomatonInterface> Clone() const override;
 
   bool Run(std::string_view input) const override;
 
+  std::optional<size_t> MatchPrefix(std::string_view input, PrefixLength length) const override;
+
+  std::optional<size_t> MatchSuffix(std::string_view input, PrefixLength length) const override;
+
+  size_t GetMemoryUsage() const override;
+
  private:
-  States states_;
-  int32_t initial_state_ = 0;
-  int32_t final_state_ = 0;
+  // Implements `MatchPrefix`, or `MatchSuffix` if `kReverse` is true.
+  template <bool kReverse>
+  std::optional<size_t> MatchImpl(std::string_view input, PrefixLength length) const;
+
+  // Returns a prefilter looking for the bytes that lead out of the initial state, or an empty one
+  // if there are too many of them or if the initial state is accepting.
+  Prefilter MakeInitialStatePrefilter() const;
+
+  // Returns the table of transitions on pairs of byte classes, or an empty one if it would take
+  // more than `kMaxPairTableBytes`. Its rows are in the same order as those of `states_` but have
+  // `num_classes_ * num_classes_` columns, and the column of a pair of classes `(c1, c2)` is
+  // `c1 * num_classes_ + c2`. Like in `states_`, states are identified by the offsets of their
+  // rows.
+  std::pmr::vector<uint32_t> MakePairStates() const;
+
+  // Runs the automaton on `input` with the table of pairs, and returns the state it ends in.
+  uint32_t RunPairs(std::string_view input) const;
+
+  // Returns true iff `state` is accepting.
+  bool IsAccepting(uint32_t const state) const {
+    return state < accepting_states_limit_ && state != kDeadState;
+  }
+
+  ByteClasses byte_classes_{};
+  int num_classes_ = 1;
+  States states_ = States(1, kDeadState);
+  StateId initial_state_ = kDeadState;
+  uint32_t special_states_limit_ = 1;
+  uint32_t accepting_states_limit_ = 1;
+  Prefilter prefilter_;
+  std::pmr::vector<uint32_t> pair_states_;
 };
 
+extern template class DFA<uint8_t>;
+extern template class DFA<uint16_t>;
+extern template class DFA<uint32_t>;
+
 }  // namespace re3
 
 #endif  // __RE3_LIB_DFA_H__
@@ -0,0 +1,59 @@
+#ifndef __RE3_LIB_FLAGS_H__
+#define __RE3_LIB_FLAGS_H__
+
+#include <cstddef>
+
+namespace re3 {
+
+struct Flags {
+  // The constructions that can turn a parsed pattern into an automaton.
+  enum class Construction {
+    // Thompson's construction, which joins the automata of the subexpressions with epsilon-moves.
+    kThompson,
+
+    // Glushkov's construction (aka the position automaton), which yields an automaton without
+    // epsilon-moves that has one state per character or character class in the pattern.
+    kGlushkov,
+  };
+
+  bool full_match = false;
+  bool case_sensitive = true;
+
+  Construction construction = Construction::kThompson;
+
+  // Maximum size in bytes of the transition table of a `DFA` generated by determinizing a
+  // non-deterministic automaton. Patterns whose DFA would be larger are run by the `ShiftAnd`
+  // engine or by the `LazyDFA`.
+  size_t max_dfa_bytes = size_t{1} << 20;
+
+  // Maximum total size in bytes of the sets of NFA states computed while determinizing an automaton
+  // ahead of time. It bounds the time taken by the determinization even if the DFA is small, since
+  // its states may stand for large sets (e.g. up to 1000 NFA states each for `.*(ab){1000}`).
+  // Automata that exceed it are run like those whose DFA is too large.
+  size_t max_determinization_bytes = size_t{1} << 23;
+
+  // DFAs with up to this many states are minimized after construction. Larger ones are left as they
+  // are to bound compilation time. Zero disables minimization.
+  size_t max_minimized_dfa_states = 10000;
+
+  // Non-deterministic automata with up to this many positions (roughly, the number of characters
+  // and character classes in the pattern) are run by the bit-parallel `ShiftAnd` engine when the
+  // `DFA` is too large. The engine supports at most 128 positions. Zero disables it.
+  size_t max_shift_and_positions = 128;
+
+  // Bounded repetitions of a single character or character class (e.g. `.{0,1000}`) whose bounds
+  // don't exceed this are unrolled into one copy of the class per repetition. Larger ones are
+  // unrolled too if the pattern stays within the parser's limits on its size and the resulting
+  // automaton can be run by the `DFA` within `max_dfa_bytes`. Otherwise they are represented by a
+  // counter, in which case the whole pattern is run by the `CountingNFA`, which is much slower than
+  // the `DFA` and doesn't stop early on a trailing `.*`.
+  int max_unrolled_class_repetitions = 100;
+
+  // Maximum number of bytes the `LazyDFA` can use to cache the states and transitions it
+  // discovers. Non-deterministic automata are simulated by a plain `NFA` if this is zero.
+  size_t lazy_dfa_cache_bytes = size_t{1} << 20;
+};
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_FLAGS_H__
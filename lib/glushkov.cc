@@ -0,0 +1,210 @@
+#include "lib/glushkov.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "lib/ast.h"
+#include "lib/flags.h"
+#include "lib/temp.h"
+
+namespace re3 {
+
+namespace {
+
+class GlushkovBuilder {
+ public:
+  explicit GlushkovBuilder(Flags const &flags, std::pmr::memory_resource *const resource)
+      : flags_(flags), resource_(resource), states_(resource), entries_(resource) {
+    // State 0 is the initial state. It's not a position, so it can't be entered.
+    states_.emplace_back();
+    entries_.emplace_back();
+  }
+
+  TempNFA Build(ASTNode const &ast) &&;
+
+ private:
+  // The positions a subexpression can start and end with, and whether it matches the empty string.
+  // `last` contains the states the follow edges start from, which are the positions themselves
+  // except for counting states, whose exit state is used instead.
+  struct Fragment {
+    std::pmr::vector<int32_t> first;
+    std::pmr::vector<int32_t> last;
+    bool nullable;
+  };
+
+  // Returns a fragment without positions, whose lists are allocated from `resource_`.
+  Fragment MakeFragment(bool const nullable) {
+    return Fragment{std::pmr::vector<int32_t>(resource_), std::pmr::vector<int32_t>(resource_),
+                    nullable};
+  }
+
+  Fragment MakeEmptyFragment() { return MakeFragment(/*nullable=*/true); }
+
+  // Adds a new state. `chars` are the characters that enter it, which are empty for states that
+  // aren't positions.
+  int32_t AddState(std::bitset<256> const &chars);
+
+  // Adds the follow edges from every state in `from` to every position in `to`.
+  void Connect(absl::Span<int32_t const> from, absl::Span<int32_t const> to);
+
+  // Concatenates `lhs` and `rhs`, adding the follow edges between them.
+  Fragment Concatenate(Fragment lhs, Fragment rhs);
+
+  Fragment Visit(ASTNode const &node);
+  Fragment VisitRepetition(ASTNode const &node);
+
+  Flags const &flags_;
+  std::pmr::memory_resource *const resource_;
+  TempNFA::States states_;
+
+  // The edges entering every state, as they appear in the states it follows. Empty for states that
+  // aren't positions.
+  TempNFA::States entries_;
+
+  std::vector<TempNFA::Counter> counters_;
+};
+
+int32_t GlushkovBuilder::AddState(std::bitset<256> const &chars) {
+  int32_t const state = states_.size();
+  states_.emplace_back();
+  entries_.push_back(MakeState(chars, state, resource_));
+  return state;
+}
+
+void GlushkovBuilder::Connect(absl::Span<int32_t const> const from,
+                              absl::Span<int32_t const> const to) {
+  for (auto const source : from) {
+    auto &edges = states_[source].edges;
+    for (auto const target : to) {
+      auto const &entry = entries_[target].edges;
+      edges.insert(edges.end(), entry.begin(), entry.end());
+    }
+  }
+}
+
+GlushkovBuilder::Fragment GlushkovBuilder::Concatenate(Fragment lhs, Fragment rhs) {
+  Connect(lhs.last, rhs.first);
+  if (lhs.nullable) {
+    lhs.first.insert(lhs.first.end(), rhs.first.begin(), rhs.first.end());
+  }
+  if (rhs.nullable) {
+    rhs.last.insert(rhs.last.end(), lhs.last.begin(), lhs.last.end());
+  }
+  return Fragment{std::move(lhs.first), std::move(rhs.last), lhs.nullable && rhs.nullable};
+}
+
+GlushkovBuilder::Fragment GlushkovBuilder::Visit(ASTNode const &node) {
+  switch (node.kind) {
+    case ASTNode::Kind::kEmpty:
+      return MakeEmptyFragment();
+    case ASTNode::Kind::kCharacterClass: {
+      int32_t const position = AddState(node.chars);
+      auto fragment = MakeFragment(/*nullable=*/false);
+      fragment.first.push_back(position);
+      fragment.last.push_back(position);
+      return fragment;
+    }
+    case ASTNode::Kind::kConcatenation: {
+      auto fragment = MakeEmptyFragment();
+      for (auto const &child : node.children) {
+        fragment = Concatenate(std::move(fragment), Visit(*child));
+      }
+      return fragment;
+    }
+    case ASTNode::Kind::kAlternation: {
+      auto fragment = MakeFragment(/*nullable=*/false);
+      for (auto const &child : node.children) {
+        auto branch = Visit(*child);
+        fragment.first.insert(fragment.first.end(), branch.first.begin(), branch.first.end());
+        fragment.last.insert(fragment.last.end(), branch.last.begin(), branch.last.end());
+        fragment.nullable |= branch.nullable;
+      }
+      return fragment;
+    }
+    case ASTNode::Kind::kRepetition:
+      return VisitRepetition(node);
+  }
+  return MakeEmptyFragment();
+}
+
+GlushkovBuilder::Fragment GlushkovBuilder::VisitRepetition(ASTNode const &node) {
+  auto const &child = *node.children[0];
+  int const min = node.min;
+  int const max = node.max;
+  if (std::max(min, max) > flags_.max_unrolled_class_repetitions &&
+      child.kind == ASTNode::Kind::kCharacterClass) {
+    // The counting state loops on the class, and the exit state is entered through the counter.
+    int32_t const position = AddState(child.chars);
+    states_[position] = entries_[position];
+    int32_t const exit_state = AddState(std::bitset<256>());
+    counters_.push_back({position, std::max(min, 1), max, exit_state});
+    auto fragment = MakeFragment(/*nullable=*/min == 0);
+    fragment.first.push_back(position);
+    fragment.last.push_back(exit_state);
+    return fragment;
+  }
+  if (max == 0) {
+    return MakeEmptyFragment();
+  }
+  auto fragment = MakeEmptyFragment();
+  for (int copy = 1; copy < min; ++copy) {
+    fragment = Concatenate(std::move(fragment), Visit(child));
+  }
+  if (max < 0) {
+    // The last copy loops on itself.
+    auto loop = Visit(child);
+    Connect(loop.last, loop.first);
+    loop.nullable |= min == 0;
+    return Concatenate(std::move(fragment), std::move(loop));
+  }
+  if (min > 0) {
+    fragment = Concatenate(std::move(fragment), Visit(child));
+  }
+  // The optional copies are nested (as in `x(x(x)?)?` rather than `xx?x?`), so that every copy only
+  // connects to the next one and the number of edges stays linear.
+  std::vector<Fragment> copies;
+  copies.reserve(max - min);
+  for (int copy = min; copy < max; ++copy) {
+    copies.push_back(Visit(child));
+  }
+  auto tail = MakeEmptyFragment();
+  for (auto it = copies.rbegin(); it != copies.rend(); ++it) {
+    tail = Concatenate(std::move(*it), std::move(tail));
+    tail.nullable = true;
+  }
+  return Concatenate(std::move(fragment), std::move(tail));
+}
+
+TempNFA GlushkovBuilder::Build(ASTNode const &ast) && {
+  auto const fragment = Visit(ast);
+  int32_t const initial_state = 0;
+  Connect({initial_state}, fragment.first);
+  int32_t const final_state = AddState(std::bitset<256>());
+  for (auto const state : fragment.last) {
+    states_[state].epsilon_moves.push_back(final_state);
+  }
+  if (fragment.nullable) {
+    states_[initial_state].epsilon_moves.push_back(final_state);
+  }
+  for (auto &state : states_) {
+    auto &edges = state.edges;
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+  }
+  return TempNFA(std::move(states_), initial_state, final_state, std::move(counters_));
+}
+
+}  // namespace
+
+TempNFA BuildGlushkovNFA(ASTNode const &ast, Flags const &flags,
+                         std::pmr::memory_resource *const resource) {
+  return GlushkovBuilder(flags, resource).Build(ast);
+}
+
+}  // namespace re3
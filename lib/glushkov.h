@@ -0,0 +1,32 @@
+#ifndef __RE3_LIB_GLUSHKOV_H__
+#define __RE3_LIB_GLUSHKOV_H__
+
+#include <memory_resource>
+
+#include "lib/ast.h"
+#include "lib/flags.h"
+#include "lib/temp.h"
+
+namespace re3 {
+
+// Builds an automaton recognizing the strings matched by `ast` using Glushkov's construction (aka
+// the position automaton). Every character class in the pattern is a position and gets exactly one
+// state, which is entered by reading a character of that class. So the automaton has no
+// epsilon-moves other than those leading to a single extra final state, which `TempNFA::Finalize`
+// collapses into the last positions of the pattern where possible.
+//
+// Repetitions are expanded by visiting their operand once per copy, each time with new positions.
+// Large bounded repetitions of a character class are represented with a counter instead, as
+// specified by `flags`: the counting state is the position of the class and the follow edges start
+// from the exit state of the counter.
+//
+// The automaton can have a quadratic number of edges in the worst case (e.g. `(a|b|c)(d|e|f)` has
+// an edge from each of the first three positions to each of the last three).
+//
+// The states of the automaton are allocated from `resource`.
+TempNFA BuildGlushkovNFA(ASTNode const &ast, Flags const &flags,
+                         std::pmr::memory_resource *resource);
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_GLUSHKOV_H__
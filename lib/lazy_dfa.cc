@@ -0,0 +1,215 @@
+#include "lib/lazy_dfa.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#include "absl/synchronization/mutex.h"
+#include "lib/automaton.h"
+#include "lib/nfa.h"
+#include "lib/sparse_set.h"
+
+namespace re3 {
+
+LazyDFA::LazyDFA(NFA nfa, ByteClasses const &byte_classes, size_t const max_cache_bytes)
+    : nfa_(std::move(nfa)),
+      byte_classes_(byte_classes),
+      num_classes_(*std::max_element(byte_classes.begin(), byte_classes.end()) + 1),
+      max_cache_bytes_(max_cache_bytes) {}
+
+std::unique_ptr<AutomatonInterface> LazyDFA::Clone() const {
+  return std::make_unique<LazyDFA>(*this);
+}
+
+bool LazyDFA::Run(std::string_view input) const {
+  auto cache = AcquireCache();
+  StateSet nfa_states{nfa_.resource()};
+  auto const result = RunCache(cache.get(), &input, &nfa_states);
+  ReleaseCache(std::move(cache));
+  // The NFA doesn't need the cache, so other runs can use it in the meantime.
+  return result.has_value() ? *result : nfa_.RunFrom(nfa_states, input);
+}
+
+std::optional<size_t> LazyDFA::MatchPrefix(std::string_view const input,
+                                           PrefixLength const length) const {
+  return MatchImpl<false>(input, length);
+}
+
+std::optional<size_t> LazyDFA::MatchSuffix(std::string_view const input,
+                                           PrefixLength const length) const {
+  return MatchImpl<true>(input, length);
+}
+
+size_t LazyDFA::GetMemoryUsage() const {
+  size_t bytes = sizeof(LazyDFA) - sizeof(NFA) + nfa_.GetMemoryUsage();
+  absl::MutexLock lock(&mutex_);
+  bytes += GetAllocatedBytes(cache_pool_);
+  // The index isn't counted exactly because its slots aren't exposed, but it's estimated the same
+  // way as by `StateCost`.
+  for (auto const &cache : cache_pool_) {
+    bytes += sizeof(Cache) + GetAllocatedBytes(cache->states) +
+             GetAllocatedBytes(cache->transitions) +
+             cache->state_index.capacity() * (sizeof(std::pair<StateSet, int32_t>) + 1) +
+             cache->step_states.GetAllocatedBytes();
+    for (auto const &state : cache->states) {
+      bytes += GetAllocatedBytes(state.nfa_states);
+    }
+    for (auto const &[nfa_states, state] : cache->state_index) {
+      bytes += GetAllocatedBytes(nfa_states);
+    }
+  }
+  return bytes;
+}
+
+size_t LazyDFA::StateCost(size_t const num_nfa_states) const {
+  return sizeof(CachedState) + num_classes_ * sizeof(int32_t) +
+         sizeof(std::pair<StateSet, int32_t>) + 1 + 2 * num_nfa_states * sizeof(int32_t);
+}
+
+std::unique_ptr<LazyDFA::Cache> LazyDFA::AcquireCache() const {
+  absl::MutexLock lock(&mutex_);
+  if (cache_pool_.empty()) {
+    return std::make_unique<Cache>(nfa_.resource(), nfa_.num_states());
+  }
+  auto cache = std::move(cache_pool_.back());
+  cache_pool_.pop_back();
+  return cache;
+}
+
+void LazyDFA::ReleaseCache(std::unique_ptr<Cache> cache) const {
+  absl::MutexLock lock(&mutex_);
+  cache_pool_.push_back(std::move(cache));
+}
+
+std::optional<bool> LazyDFA::RunCache(Cache *const cache, std::string_view *const input,
+                                      StateSet *const nfa_states) const {
+  int32_t state = GetInitialState(cache);
+  int num_flushes = 0;
+  while (!input->empty()) {
+    int32_t const next_state = GetTransition(cache, state, (*input)[0], &num_flushes, nfa_states);
+    input->remove_prefix(1);
+    if (next_state == kUnknownState) {
+      return std::nullopt;
+    }
+    if (cache->states[next_state].nfa_states.empty()) {
+      return false;
+    }
+    state = next_state;
+  }
+  return cache->states[state].accepting;
+}
+
+template <bool kReverse>
+std::optional<size_t> LazyDFA::MatchImpl(std::string_view const input,
+                                         PrefixLength const length) const {
+  auto cache = AcquireCache();
+  std::optional<size_t> result;
+  size_t num_read = 0;
+  StateSet nfa_states{nfa_.resource()};
+  bool const done =
+      MatchCache<kReverse>(cache.get(), input, length, &result, &num_read, &nfa_states);
+  ReleaseCache(std::move(cache));
+  if (done) {
+    return result;
+  }
+  auto const rest =
+      kReverse ? nfa_.MatchSuffixFrom(nfa_states, input.substr(0, input.size() - num_read), length)
+               : nfa_.MatchPrefixFrom(nfa_states, input.substr(num_read), length);
+  return rest.has_value() ? num_read + *rest : result;
+}
+
+template <bool kReverse>
+bool LazyDFA::MatchCache(Cache *const cache, std::string_view const input,
+                         PrefixLength const length, std::optional<size_t> *const result,
+                         size_t *const num_read, StateSet *const nfa_states) const {
+  int32_t state = GetInitialState(cache);
+  int num_flushes = 0;
+  for (size_t i = 0; i < input.size(); ++i) {
+    if (cache->states[state].accepting) {
+      *result = i;
+      if (length == PrefixLength::kShortest) {
+        return true;
+      }
+    }
+    int32_t const next_state = GetTransition(cache, state, GetCharacter<kReverse>(input, i),
+                                             &num_flushes, nfa_states);
+    if (next_state == kUnknownState) {
+      *num_read = i + 1;
+      return false;
+    }
+    if (cache->states[next_state].nfa_states.empty()) {
+      return true;
+    }
+    state = next_state;
+  }
+  if (cache->states[state].accepting) {
+    *result = input.size();
+  }
+  return true;
+}
+
+int32_t LazyDFA::GetInitialState(Cache *const cache) const {
+  if (cache->initial_state == kUnknownState) {
+    auto const nfa_states = nfa_.EpsilonClosure(nfa_.initial_state());
+    StateSet sorted_states(nfa_states.begin(), nfa_states.end(), nfa_.resource());
+    std::sort(sorted_states.begin(), sorted_states.end());
+    cache->initial_state = GetState(cache, std::move(sorted_states));
+  }
+  return cache->initial_state;
+}
+
+int32_t LazyDFA::GetState(Cache *const cache, StateSet nfa_states) const {
+  auto const [it, inserted] = cache->state_index.try_emplace(nfa_states, cache->states.size());
+  if (inserted) {
+    cache->bytes += StateCost(nfa_states.size());
+    bool const accepting = std::binary_search(nfa_states.begin(), nfa_states.end(),
+                                              nfa_.final_state());
+    cache->states.emplace_back(std::move(nfa_states), accepting);
+    cache->transitions.insert(cache->transitions.end(), num_classes_, kUnknownState);
+  }
+  return it->second;
+}
+
+int32_t LazyDFA::GetTransition(Cache *const cache, int32_t state, uint8_t const ch,
+                               int *const num_flushes, StateSet *const nfa_states) const {
+  int32_t next_state = cache->transitions[state * num_classes_ + byte_classes_[ch]];
+  if (next_state == kUnknownState) {
+    *nfa_states = Step(cache, cache->states[state].nfa_states, ch);
+    if (!cache->state_index.contains(*nfa_states) &&
+        cache->bytes + StateCost(nfa_states->size()) > max_cache_bytes_) {
+      if (++*num_flushes > kMaxCacheFlushesPerRun) {
+        return kUnknownState;
+      }
+      auto current_states = std::move(cache->states[state].nfa_states);
+      FlushCache(cache);
+      state = GetState(cache, std::move(current_states));
+    }
+    next_state = GetState(cache, std::move(*nfa_states));
+    cache->transitions[state * num_classes_ + byte_classes_[ch]] = next_state;
+  }
+  return next_state;
+}
+
+LazyDFA::StateSet LazyDFA::Step(Cache *const cache, StateSet const &nfa_states,
+                                uint8_t const ch) const {
+  auto &step_states = cache->step_states;
+  step_states.Clear();
+  nfa_.Step(nfa_states, ch, &step_states);
+  StateSet sorted_states(step_states.begin(), step_states.end(), nfa_.resource());
+  std::sort(sorted_states.begin(), sorted_states.end());
+  return sorted_states;
+}
+
+void LazyDFA::FlushCache(Cache *const cache) {
+  cache->states.clear();
+  cache->transitions.clear();
+  cache->state_index.clear();
+  cache->initial_state = kUnknownState;
+  cache->bytes = 0;
+}
+
+}  // namespace re3
@@ -0,0 +1,163 @@
+#ifndef __RE3_LIB_LAZY_DFA_H__
+#define __RE3_LIB_LAZY_DFA_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/hash/hash.h"
+#include "absl/synchronization/mutex.h"
+#include "lib/automaton.h"
+#include "lib/dfa.h"
+#include "lib/nfa.h"
+#include "lib/sparse_set.h"
+
+namespace re3 {
+
+// Runs a non-deterministic automaton by determinizing it on the fly.
+//
+// Every state of the DFA corresponds to a set of `NFA` states. States and their transitions are
+// computed the first time the input leads to them and are then cached, so that subsequent runs
+// only need one table lookup per input character in the common case.
+//
+// The cache is bounded by a memory budget. When the budget is exceeded the whole cache is flushed
+// and rebuilt from the current state; if that happens too many times during a single run the input
+// is likely making the cache thrash, so `LazyDFA` falls back to simulating the `NFA` for the rest
+// of that run.
+//
+// `Run`, `MatchPrefix`, and `MatchSuffix` are thread-safe. Every run takes a cache from a pool and
+// returns it when it's done, the same way `NFA` takes its scratch sets, so concurrent runs don't
+// serialize: each one uses a different cache, and the lock is only held to take and return it.
+// Caches persist across runs, so sequential runs share the states discovered so far. Each cache
+// has its own memory budget.
+//
+// The caches are allocated from the same memory resource as the tables of the `NFA`.
+class LazyDFA final : public AutomatonInterface {
+ public:
+  // Maximum number of cache flushes allowed in a single run before falling back to the NFA.
+  static inline int constexpr kMaxCacheFlushesPerRun = 3;
+
+  // `byte_classes` must partition the input characters so that characters in the same class always
+  // lead to the same states of `nfa` (see `ByteClasses`). The cache only stores one transition
+  // per class.
+  explicit LazyDFA(NFA nfa, ByteClasses const &byte_classes, size_t max_cache_bytes);
+
+  // Copies don't share the caches, they start out with none.
+  LazyDFA(LazyDFA const &other)
+      : LazyDFA(other.nfa_, other.byte_classes_, other.max_cache_bytes_) {}
+
+  std::unique_ptr<AutomatonInterface> Clone() const override;
+
+  bool Run(std::string_view input) const override;
+
+  std::optional<size_t> MatchPrefix(std::string_view input, PrefixLength length) const override;
+
+  std::optional<size_t> MatchSuffix(std::string_view input, PrefixLength length) const override;
+
+  size_t GetMemoryUsage() const override;
+
+ private:
+  // Transition value indicating that the transition hasn't been computed yet.
+  static inline int32_t constexpr kUnknownState = -1;
+
+  // Sorted list of NFA states making up a DFA state.
+  using StateSet = std::pmr::vector<int32_t>;
+
+  struct CachedState {
+    explicit CachedState(StateSet nfa_states, bool const accepting)
+        : nfa_states(std::move(nfa_states)), accepting(accepting) {}
+
+    StateSet nfa_states;
+    bool accepting;
+  };
+
+  // The states and transitions discovered so far by the runs that used this cache.
+  struct Cache {
+    explicit Cache(std::pmr::memory_resource *const resource, size_t const num_nfa_states)
+        : states(resource), transitions(resource), state_index(resource),
+          step_states(num_nfa_states) {}
+
+    std::pmr::vector<CachedState> states;
+
+    // Cached transitions, laid out like `TempDFA::States`.
+    std::pmr::vector<int32_t> transitions;
+
+    absl::flat_hash_map<StateSet, int32_t, absl::Hash<StateSet>, std::equal_to<StateSet>,
+                        std::pmr::polymorphic_allocator<std::pair<StateSet const, int32_t>>>
+        state_index;
+
+    int32_t initial_state = kUnknownState;
+    size_t bytes = 0;
+
+    // Scratch set used by `Step`.
+    SparseSet step_states;
+  };
+
+  // Estimates the memory taken by a cached state with `num_nfa_states` NFA states, including its
+  // transitions and its entry in the index.
+  size_t StateCost(size_t num_nfa_states) const;
+
+  // Takes a cache from the pool, or allocates a new empty one if the pool is empty.
+  std::unique_ptr<Cache> AcquireCache() const;
+
+  // Returns a cache to the pool.
+  void ReleaseCache(std::unique_ptr<Cache> cache) const;
+
+  // Runs the DFA on `input` with `cache`. Returns `std::nullopt` if the run has to fall back to the
+  // NFA, in which case the characters that were read are removed from `input` and the NFA states
+  // reached are stored in `nfa_states`.
+  std::optional<bool> RunCache(Cache *cache, std::string_view *input, StateSet *nfa_states) const;
+
+  // Shared implementation of `MatchPrefix` and `MatchSuffix`.
+  template <bool kReverse>
+  std::optional<size_t> MatchImpl(std::string_view input, PrefixLength length) const;
+
+  // Like `MatchImpl`, but with `cache`. Returns false if the run has to fall back to the NFA after
+  // reading `*num_read` characters, in which case the NFA states reached are stored in
+  // `nfa_states`. `result` is set to the match found so far either way.
+  template <bool kReverse>
+  bool MatchCache(Cache *cache, std::string_view input, PrefixLength length,
+                  std::optional<size_t> *result, size_t *num_read, StateSet *nfa_states) const;
+
+  // Returns the DFA state containing the initial state of the NFA and its epsilon-closure, adding
+  // it to `cache` if necessary.
+  int32_t GetInitialState(Cache *cache) const;
+
+  // Returns the DFA state corresponding to the provided set of NFA states, adding it to `cache` if
+  // necessary.
+  int32_t GetState(Cache *cache, StateSet nfa_states) const;
+
+  // Returns the DFA state reached from `state` by reading `ch`, computing and caching it if
+  // necessary. If that would flush the cache more than `kMaxCacheFlushesPerRun` times in the
+  // current run, as counted by `num_flushes`, the new state isn't cached: its NFA states are stored
+  // in `nfa_states` and `kUnknownState` is returned, so that the run can fall back to the NFA.
+  int32_t GetTransition(Cache *cache, int32_t state, uint8_t ch, int *num_flushes,
+                        StateSet *nfa_states) const;
+
+  // Computes the set of NFA states reached from `nfa_states` by reading `ch`, including the
+  // epsilon-closure.
+  StateSet Step(Cache *cache, StateSet const &nfa_states, uint8_t ch) const;
+
+  // Drops all cached states and transitions.
+  static void FlushCache(Cache *cache);
+
+  NFA const nfa_;
+  ByteClasses const byte_classes_;
+  int const num_classes_;
+  size_t const max_cache_bytes_;
+
+  mutable absl::Mutex mutex_;
+  mutable std::vector<std::unique_ptr<Cache>> cache_pool_ ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_LAZY_DFA_H__
@@ -1,48 +1,237 @@
 #include "lib/nfa.h"
 
+#include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <optional>
 #include <string_view>
 #include <utility>
+#include <vector>
 
-#include "absl/container/flat_hash_set.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "lib/automaton.h"
+#include "lib/sparse_set.h"
 
 namespace re3 {
 
+NFA::NFA(std::pmr::vector<uint32_t> edge_offsets, std::pmr::vector<Edge> edges,
+         std::pmr::vector<int32_t> targets, absl::Span<uint32_t const> const epsilon_offsets,
+         absl::Span<int32_t const> const epsilon_targets, int32_t const initial_state,
+         int32_t const final_state)
+    : edge_offsets_(std::move(edge_offsets)),
+      edges_(std::move(edges)),
+      targets_(std::move(targets)),
+      initial_state_(initial_state),
+      final_state_(final_state),
+      closure_offsets_(resource()),
+      closure_states_(resource()) {
+  closure_offsets_.reserve(num_states() + 1);
+  closure_offsets_.push_back(0);
+  SparseSet closure{num_states()};
+  std::vector<int32_t> stack;
+  for (int32_t state = 0; state < num_states(); ++state) {
+    closure.Clear();
+    closure.Insert(state);
+    stack.push_back(state);
+    while (!stack.empty()) {
+      auto const state_num = stack.back();
+      stack.pop_back();
+      for (auto i = epsilon_offsets[state_num]; i < epsilon_offsets[state_num + 1]; ++i) {
+        auto const transition = epsilon_targets[i];
+        if (closure.Insert(transition)) {
+          stack.push_back(transition);
+        }
+      }
+    }
+    // States without labeled edges can't lead anywhere once the epsilon-moves have been followed,
+    // so they're only kept if they're final.
+    for (auto const closure_state : closure) {
+      if (closure_state == final_state_ || !this->edges(closure_state).empty()) {
+        closure_states_.push_back(closure_state);
+      }
+    }
+    closure_offsets_.push_back(closure_states_.size());
+  }
+}
+
+NFA::NFA(NFA const &other)
+    : edge_offsets_(other.edge_offsets_, other.resource()),
+      edges_(other.edges_, other.resource()),
+      targets_(other.targets_, other.resource()),
+      initial_state_(other.initial_state_),
+      final_state_(other.final_state_),
+      closure_offsets_(other.closure_offsets_, other.resource()),
+      closure_states_(other.closure_states_, other.resource()) {}
+
+NFA::NFA(NFA &&other) noexcept
+    : edge_offsets_(std::move(other.edge_offsets_)),
+      edges_(std::move(other.edges_)),
+      targets_(std::move(other.targets_)),
+      initial_state_(other.initial_state_),
+      final_state_(other.final_state_),
+      closure_offsets_(std::move(other.closure_offsets_)),
+      closure_states_(std::move(other.closure_states_)) {}
+
+NFA &NFA::operator=(NFA &&other) noexcept {
+  edge_offsets_ = std::move(other.edge_offsets_);
+  edges_ = std::move(other.edges_);
+  targets_ = std::move(other.targets_);
+  initial_state_ = other.initial_state_;
+  final_state_ = other.final_state_;
+  closure_offsets_ = std::move(other.closure_offsets_);
+  closure_states_ = std::move(other.closure_states_);
+  absl::MutexLock lock(&mutex_);
+  scratch_pool_.clear();
+  return *this;
+}
+
 std::unique_ptr<AutomatonInterface> NFA::Clone() const { return std::make_unique<NFA>(*this); }
 
-bool NFA::Run(std::string_view input) const {
-  absl::flat_hash_set<int32_t> states{initial_state_};
-  states.reserve(states_.size());
-  EpsilonClosure(&states);
-  absl::flat_hash_set<int32_t> next_states;
-  while (!input.empty()) {
-    uint8_t const ch = input[0];
-    input.remove_prefix(1);
-    next_states.reserve(states_.size());
-    for (auto const state_num : states) {
-      for (auto const transition : states_[state_num][ch]) {
-        next_states.emplace(transition);
+bool NFA::Run(std::string_view const input) const {
+  auto scratch = AcquireScratch();
+  for (auto const state : EpsilonClosure(initial_state_)) {
+    scratch->states.Insert(state);
+  }
+  bool const result = RunScratch(scratch.get(), input);
+  ReleaseScratch(std::move(scratch));
+  return result;
+}
+
+std::optional<size_t> NFA::MatchPrefix(std::string_view const input,
+                                       PrefixLength const length) const {
+  return MatchFrom<false>(EpsilonClosure(initial_state_), input, length);
+}
+
+std::optional<size_t> NFA::MatchSuffix(std::string_view const input,
+                                       PrefixLength const length) const {
+  return MatchFrom<true>(EpsilonClosure(initial_state_), input, length);
+}
+
+size_t NFA::GetMemoryUsage() const {
+  size_t bytes = sizeof(NFA) + GetAllocatedBytes(edge_offsets_) + GetAllocatedBytes(edges_) +
+                 GetAllocatedBytes(targets_) + GetAllocatedBytes(closure_offsets_) +
+                 GetAllocatedBytes(closure_states_);
+  absl::MutexLock lock(&mutex_);
+  bytes += GetAllocatedBytes(scratch_pool_);
+  for (auto const &scratch : scratch_pool_) {
+    bytes += sizeof(Scratch) + scratch->states.GetAllocatedBytes() +
+             scratch->next_states.GetAllocatedBytes();
+  }
+  return bytes;
+}
+
+bool NFA::RunFrom(absl::Span<int32_t const> const states, std::string_view const input) const {
+  auto scratch = AcquireScratch();
+  for (auto const state : states) {
+    scratch->states.Insert(state);
+  }
+  bool const result = RunScratch(scratch.get(), input);
+  ReleaseScratch(std::move(scratch));
+  return result;
+}
+
+std::optional<size_t> NFA::MatchPrefixFrom(absl::Span<int32_t const> const states,
+                                           std::string_view const input,
+                                           PrefixLength const length) const {
+  return MatchFrom<false>(states, input, length);
+}
+
+std::optional<size_t> NFA::MatchSuffixFrom(absl::Span<int32_t const> const states,
+                                           std::string_view const input,
+                                           PrefixLength const length) const {
+  return MatchFrom<true>(states, input, length);
+}
+
+void NFA::Step(absl::Span<int32_t const> const states, uint8_t const ch,
+               SparseSet *const next_states) const {
+  for (auto const state : states) {
+    // The edges are sorted and disjoint, so the only edge that may match `ch` is the first one that
+    // doesn't end before it.
+    auto const state_edges = edges(state);
+    auto edge = state_edges.begin();
+    while (edge != state_edges.end() && edge->last < ch) {
+      ++edge;
+    }
+    if (edge == state_edges.end() || edge->first > ch) {
+      continue;
+    }
+    for (auto const transition : targets(*edge)) {
+      if (!next_states->Contains(transition)) {
+        for (auto const next_state : EpsilonClosure(transition)) {
+          next_states->Insert(next_state);
+        }
       }
     }
-    EpsilonClosure(&next_states);
-    states = std::move(next_states);
-    next_states = absl::flat_hash_set<int32_t>();
   }
-  return states.contains(final_state_);
 }
 
-void NFA::EpsilonClosure(absl::flat_hash_set<int32_t>* const states) const {
-  bool new_state_found;
-  do {
-    new_state_found = false;
-    for (auto const state_num : *states) {
-      for (auto const transition : states_[state_num][0]) {
-        auto const [it, inserted] = states->emplace(transition);
-        new_state_found |= inserted;
+std::unique_ptr<NFA::Scratch> NFA::AcquireScratch() const {
+  absl::MutexLock lock(&mutex_);
+  if (scratch_pool_.empty()) {
+    return std::make_unique<Scratch>(num_states());
+  }
+  auto scratch = std::move(scratch_pool_.back());
+  scratch_pool_.pop_back();
+  return scratch;
+}
+
+void NFA::ReleaseScratch(std::unique_ptr<Scratch> scratch) const {
+  scratch->states.Clear();
+  scratch->next_states.Clear();
+  absl::MutexLock lock(&mutex_);
+  scratch_pool_.push_back(std::move(scratch));
+}
+
+bool NFA::RunScratch(Scratch *const scratch, std::string_view const input) const {
+  SparseSet *states = &scratch->states;
+  SparseSet *next_states = &scratch->next_states;
+  for (uint8_t const ch : input) {
+    if (states->empty()) {
+      return false;
+    }
+    next_states->Clear();
+    Step(absl::MakeConstSpan(states->begin(), states->end()), ch, next_states);
+    std::swap(states, next_states);
+  }
+  return states->Contains(final_state_);
+}
+
+template <bool kReverse>
+std::optional<size_t> NFA::MatchScratch(Scratch *const scratch, std::string_view const input,
+                                        PrefixLength const length) const {
+  SparseSet *states = &scratch->states;
+  SparseSet *next_states = &scratch->next_states;
+  std::optional<size_t> result;
+  for (size_t i = 0; !states->empty(); ++i) {
+    if (states->Contains(final_state_)) {
+      result = i;
+      if (length == PrefixLength::kShortest) {
+        break;
       }
     }
-  } while (new_state_found);
+    if (i == input.size()) {
+      break;
+    }
+    next_states->Clear();
+    Step(absl::MakeConstSpan(states->begin(), states->end()), GetCharacter<kReverse>(input, i),
+         next_states);
+    std::swap(states, next_states);
+  }
+  return result;
+}
+
+template <bool kReverse>
+std::optional<size_t> NFA::MatchFrom(absl::Span<int32_t const> const states,
+                                     std::string_view const input,
+                                     PrefixLength const length) const {
+  auto scratch = AcquireScratch();
+  for (auto const state : states) {
+    scratch->states.Insert(state);
+  }
+  auto const result = MatchScratch<kReverse>(scratch.get(), input, length);
+  ReleaseScratch(std::move(scratch));
+  return result;
 }
 
 }  // namespace re3
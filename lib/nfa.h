@@ -1,48 +1,165 @@
 #ifndef __RE3_LIB_NFA_H__
 #define __RE3_LIB_NFA_H__
 
-#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string_view>
 #include <utility>
 #include <vector>
 
-#include "absl/container/flat_hash_set.h"
-#include "absl/container/inlined_vector.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
 #include "lib/automaton.h"
+#include "lib/sparse_set.h"
 
 namespace re3 {
 
 // Represents a non-deterministic finite automaton (NFA), aka a compiled regular expression.
+//
+// `Run` simulates the automaton by keeping track of the set of states it's in, stepping all of them
+// at every input character. The epsilon-closure of every state is computed once at construction
+// (leaving out the states that only have epsilon-moves), and the state sets are `SparseSet`s that
+// are reused across runs, so the simulation doesn't allocate any memory in the steady state.
+//
+// Transitions are stored in compressed sparse rows: the edges of all states are in a single array,
+// each state owning a contiguous slice of it, and the targets of all edges are in another one. Each
+// edge is labeled with a range of characters, so most states only have one or two edges.
+//
+// All tables are allocated from the memory resource of the vectors passed at construction. The
+// scratch sets are allocated on the heap.
 class NFA final : public AutomatonInterface {
  public:
-  // `State` is represented by an array of 256 edges, one for every possible input character. Each
-  // edge is an array of integers representing the states to transition to. Character 0 is used to
-  // label epsilon-moves.
-  using State = std::array<absl::InlinedVector<int32_t, 1>, 256>;
-  using States = std::vector<State>;
+  // An edge labeled with all the characters in the range `[first, last]` and leading to the states
+  // `targets[targets_begin ... targets_end]`.
+  struct Edge {
+    uint8_t first;
+    uint8_t last;
+    uint32_t targets_begin;
+    uint32_t targets_end;
+  };
 
-  explicit NFA() = default;
+  // Builds an automaton with only one state, which is both initial and final.
+  explicit NFA() : NFA({0, 0}, {}, {}, {0, 0}, {}, 0, 0) {}
 
-  explicit NFA(States states, int32_t const initial_state, int32_t const final_state)
-      : states_(std::move(states)), initial_state_(initial_state), final_state_(final_state) {}
+  // The edges of state `i` are `edges[edge_offsets[i] ... edge_offsets[i + 1]]`, so `edge_offsets`
+  // has one more element than the number of states. The ranges of the edges of every state must be
+  // sorted and disjoint, so at most one edge matches any given character. Similarly, the targets of
+  // the epsilon-moves of state `i` are
+  // `epsilon_targets[epsilon_offsets[i] ... epsilon_offsets[i + 1]]`. Epsilon-moves are only used
+  // to compute the epsilon-closures and aren't retained.
+  explicit NFA(std::pmr::vector<uint32_t> edge_offsets, std::pmr::vector<Edge> edges,
+               std::pmr::vector<int32_t> targets, absl::Span<uint32_t const> epsilon_offsets,
+               absl::Span<int32_t const> epsilon_targets, int32_t initial_state,
+               int32_t final_state);
 
-  NFA(NFA const &) = default;
-  NFA &operator=(NFA const &) = default;
-  NFA(NFA &&) noexcept = default;
-  NFA &operator=(NFA &&) noexcept = default;
+  // Copies don't share the scratch sets of the original, and allocate their tables from the same
+  // memory resource.
+  NFA(NFA const &other);
+
+  NFA &operator=(NFA const &other) { return *this = NFA(other); }
+
+  NFA(NFA &&other) noexcept;
+  NFA &operator=(NFA &&other) noexcept;
+
+  size_t num_states() const { return edge_offsets_.size() - 1; }
+
+  // The memory resource the tables are allocated from.
+  std::pmr::memory_resource *resource() const { return edges_.get_allocator().resource(); }
+
+  absl::Span<Edge const> edges(int32_t const state) const {
+    return absl::MakeConstSpan(edges_.data() + edge_offsets_[state],
+                               edges_.data() + edge_offsets_[state + 1]);
+  }
+
+  absl::Span<int32_t const> targets(Edge const &edge) const {
+    return absl::MakeConstSpan(targets_.data() + edge.targets_begin,
+                               targets_.data() + edge.targets_end);
+  }
+
+  int32_t initial_state() const { return initial_state_; }
+  int32_t final_state() const { return final_state_; }
 
   std::unique_ptr<AutomatonInterface> Clone() const override;
 
   bool Run(std::string_view input) const override;
 
+  std::optional<size_t> MatchPrefix(std::string_view input, PrefixLength length) const override;
+
+  std::optional<size_t> MatchSuffix(std::string_view input, PrefixLength length) const override;
+
+  size_t GetMemoryUsage() const override;
+
+  // Runs the automaton on `input` starting from the specified set of `states` rather than from the
+  // initial state. `states` must be closed under epsilon-moves (see `EpsilonClosure`).
+  bool RunFrom(absl::Span<int32_t const> states, std::string_view input) const;
+
+  // Like `MatchPrefix`, but starts from the specified set of `states` like `RunFrom`.
+  std::optional<size_t> MatchPrefixFrom(absl::Span<int32_t const> states, std::string_view input,
+                                        PrefixLength length) const;
+
+  // Like `MatchSuffix`, but starts from the specified set of `states` like `RunFrom`.
+  std::optional<size_t> MatchSuffixFrom(absl::Span<int32_t const> states, std::string_view input,
+                                        PrefixLength length) const;
+
+  // Returns the states that can be reached from `state` through epsilon-moves, including `state`
+  // itself. States that have no labeled edges and aren't final are left out because they don't
+  // affect the outcome of a run.
+  absl::Span<int32_t const> EpsilonClosure(int32_t const state) const {
+    return absl::MakeConstSpan(closure_states_.data() + closure_offsets_[state],
+                               closure_states_.data() + closure_offsets_[state + 1]);
+  }
+
+  // Adds to `next_states` the epsilon-closure of the states reached from `states` by reading `ch`.
+  // `next_states` must have a capacity of at least `num_states()`.
+  void Step(absl::Span<int32_t const> states, uint8_t ch, SparseSet *next_states) const;
+
  private:
-  void EpsilonClosure(absl::flat_hash_set<int32_t> *states) const;
+  // A pair of state sets used by a single run.
+  struct Scratch {
+    explicit Scratch(size_t const num_states) : states(num_states), next_states(num_states) {}
+
+    SparseSet states;
+    SparseSet next_states;
+  };
+
+  // Takes a scratch from the pool, or allocates a new one if the pool is empty. Concurrent runs use
+  // different scratches.
+  std::unique_ptr<Scratch> AcquireScratch() const;
+
+  // Returns a scratch to the pool.
+  void ReleaseScratch(std::unique_ptr<Scratch> scratch) const;
 
-  States states_;
+  // Runs the automaton on `input` starting from `scratch->states`.
+  bool RunScratch(Scratch *scratch, std::string_view input) const;
+
+  // Looks for an accepted prefix (or, if `kReverse` is set, suffix) of `input` starting from
+  // `scratch->states`.
+  template <bool kReverse>
+  std::optional<size_t> MatchScratch(Scratch *scratch, std::string_view input,
+                                     PrefixLength length) const;
+
+  // Shared implementation of `MatchPrefixFrom` and `MatchSuffixFrom`.
+  template <bool kReverse>
+  std::optional<size_t> MatchFrom(absl::Span<int32_t const> states, std::string_view input,
+                                  PrefixLength length) const;
+
+  std::pmr::vector<uint32_t> edge_offsets_;
+  std::pmr::vector<Edge> edges_;
+  std::pmr::vector<int32_t> targets_;
   int32_t initial_state_ = 0;
   int32_t final_state_ = 0;
+
+  // Epsilon-closures of all states, stored back to back. The closure of state `i` is
+  // `closure_states_[closure_offsets_[i] ... closure_offsets_[i + 1]]`.
+  std::pmr::vector<int32_t> closure_offsets_;
+  std::pmr::vector<int32_t> closure_states_;
+
+  mutable absl::Mutex mutex_;
+  mutable std::vector<std::unique_ptr<Scratch>> scratch_pool_ ABSL_GUARDED_BY(mutex_);
 };
 
 }  // namespace re3
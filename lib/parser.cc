@@ -1,17 +1,27 @@
 #include "lib/parser.h"
 
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string_view>
 #include <utility>
+#include <vector>
 
-#include "absl/container/flat_hash_map.h"
-#include "absl/container/inlined_vector.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/strip.h"
+#include "lib/ast.h"
 #include "lib/automaton.h"
+#include "lib/flags.h"
+#include "lib/glushkov.h"
+#include "lib/prefilter.h"
+#include "lib/simplify.h"
 #include "lib/temp.h"
+#include "lib/thompson.h"
 
 namespace re3 {
 
@@ -20,16 +30,45 @@ namespace {
 // Parses a regular expression and compiles it into a runnable automaton.
 class Parser {
  public:
-  static inline int constexpr kMaxNumericQuantifier = 1000;
-
-  // Constructs a parser to parse the provided regular expression `pattern`.
-  explicit Parser(std::string_view const pattern) : pattern_(pattern) {}
-
-  // Parses the pattern provided at construction and returns a runnable automaton. The automaton is
-  // initially an `NFA` but it's automatically converted to a `DFA` if it's found to be
-  // deterministic. We do that because DFAs run faster.
+  static inline int constexpr kMaxNumericQuantifier = 100000;
+
+  // Repetitions that aren't represented by counters (see `TempNFA::RepeatWithCounter`) are unrolled
+  // into one copy of their operand per repetition, so their bounds are limited more strictly.
+  static inline int constexpr kMaxUnrolledRepetitions = 1000;
+
+  // Maximum number of positions (i.e. copies of characters and character classes) in the unrolled
+  // pattern, which bounds the size of the automaton when repetitions are nested.
+  static inline size_t constexpr kMaxPositions = 20000;
+
+  // `SimplifyAST` and the automaton constructions walk the syntax tree recursively, so the nesting
+  // depth of round brackets is limited to bound their stack usage. The parser itself isn't
+  // recursive.
+  static inline size_t constexpr kMaxNestingDepth = 1000;
+
+  // The characters matched by the `\d`, `\w`, and `\s` escape codes.
+  static inline std::string_view constexpr kDigits = "0123456789";
+  static inline std::string_view constexpr kWordCharacters =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_";
+  // TODO: add Unicode spaces.
+  static inline std::string_view constexpr kSpaces = "\f\n\r\t\v";
+
+  // Constructs a parser to parse the provided regular expression `pattern`. The tables of the
+  // automaton returned by `Parse` are allocated from `resource`.
+  explicit Parser(std::string_view const pattern, Flags const& flags,
+                  std::pmr::memory_resource* const resource)
+      : pattern_(pattern), flags_(flags), resource_(resource), ast_(&arena_) {}
+
+  // Parses the pattern provided at construction into an `AST`, simplifies it, builds an
+  // automaton with the construction selected in the flags, and returns it in runnable form. The
+  // engine that runs it is picked by `TempNFA::Finalize`.
+  //
+  // All intermediate data structures are allocated from the arena of the parser, only the returned
+  // automaton outlives it.
   absl::StatusOr<std::unique_ptr<AutomatonInterface>> Parse();
 
+  // Like `Parse`, but also compiles the unanchored automaton if the flags ask for searches.
+  absl::StatusOr<Automata> Compile();
+
  private:
   // Parses a hex digit. Used by `ParseHexCode` to parse hex escape codes.
   static absl::StatusOr<int> ParseHexDigit(int ch);
@@ -37,44 +76,114 @@ class Parser {
   // Parses the next two characters as a hex byte. Used to parse hex escape codes.
   absl::StatusOr<int> ParseHexCode();
 
-  TempNFA MakeSingleCharacterNFA(int ch);
-  TempNFA MakeCharacterClassNFA(std::string_view chars);
-  TempNFA MakeNegatedCharacterClassNFA(std::string_view chars);
+  // Returns the set of the characters in `chars`.
+  static std::bitset<256> MakeCharacterSet(std::string_view chars);
 
-  static absl::Status UpdateCharacterClassEdge(bool negated, State* start_state, uint8_t ch,
-                                               int stop_state_num);
+  // Returns the set of the characters in the range `[first, last]`.
+  static std::bitset<256> MakeCharacterRange(uint8_t first, uint8_t last);
 
-  // Called by `ParseCharacterClass` to parse escape codes. `negated` indicates whether the
-  // character class is negated (i.e. it begins with ^). `state` is the NFA state to update with the
-  // characters resulting from the escape code. Returns an error status if the escape code is
-  // invalid.
+  ASTNode* MakeSingleCharacter(uint8_t ch);
+  ASTNode* MakeCharacterClass(std::string_view chars);
+  ASTNode* MakeNegatedCharacterClass(std::string_view chars);
+
+  // Returns a node matching the concatenation of `pieces`, which may be empty.
+  ASTNode* MakeSequence(std::vector<ASTNode*> const& pieces);
+
+  // Called by `ParseCharacterClass` to parse the escape codes that stand for a set of characters
+  // (e.g. `\d`). Returns `std::nullopt` without consuming anything if the pattern doesn't begin
+  // with one of them.
+  std::optional<std::bitset<256>> ParseCharacterClassShorthand();
+
+  // Called by `ParseCharacterClass` to parse escape codes that stand for a single character.
+  // Returns an error status if the escape code is invalid.
   //
   // REQUIRES: the backslash before the escape code must have already been consumed.
-  absl::Status ParseCharacterClassEscapeCode(bool negated, State* start_state, int stop_state_num);
+  absl::StatusOr<uint8_t> ParseCharacterClassEscapeCode();
 
-  // Called by `Parse0` to parse character classes (i.e. square brackets).
-  absl::StatusOr<TempNFA> ParseCharacterClass();
+  // Called by `ParseCharacterClass` to parse a single character, either plain or escaped, e.g. one
+  // of the ends of a range.
+  absl::StatusOr<uint8_t> ParseCharacterClassCharacter();
 
-  // Called by `Parse0` to parse escape codes (e.g. `\d`, `\w`, etc.).
-  absl::StatusOr<TempNFA> ParseEscape();
+  // Called by `ParseAtom` to parse character classes (i.e. square brackets).
+  absl::StatusOr<ASTNode*> ParseCharacterClass();
 
-  // Parses single character, escape code, dot, round brackets, square brackets, or end of input.
-  absl::StatusOr<TempNFA> Parse0();
+  // Called by `ParseAtom` to parse escape codes (e.g. `\d`, `\w`, etc.).
+  absl::StatusOr<ASTNode*> ParseEscape();
+
+  // Parses single character, escape code, dot, or square brackets. Round brackets and pipes are
+  // handled by `ParseAST`.
+  //
+  // REQUIRES: the pattern must not be empty.
+  absl::StatusOr<ASTNode*> ParseAtom();
 
   // Parses the content of the curly braces in quantifiers.
   absl::StatusOr<std::pair<int, int>> ParseQuantifier();
 
-  // Parses Kleene star, plus, question mark, or quantifier.
-  absl::StatusOr<TempNFA> Parse1();
+  // Parses the Kleene star, plus, question mark, or quantifier following `node`, if any, and
+  // returns `node` repeated accordingly.
+  absl::StatusOr<ASTNode*> ParseRepetition(ASTNode* node);
 
-  // Parses sequences.
-  absl::StatusOr<TempNFA> Parse2();
+  // Parses the whole pattern into `ast_`. Round brackets are tracked with an explicit stack rather
+  // than by recursion, so the stack usage doesn't depend on the pattern.
+  absl::Status ParseAST();
 
-  // Parses the pipe operator.
-  absl::StatusOr<TempNFA> Parse3();
+  // Returns the number of positions of the tree rooted at `node` once its repetitions are
+  // unrolled, or an error if that exceeds `kMaxPositions` or if a repetition that isn't represented
+  // by a counter exceeds `kMaxUnrolledRepetitions`. Called on the simplified tree, since
+  // simplification may turn operands into character classes and combine nested repetitions.
+  //
+  // Class repetitions whose bounds exceed `max_unrolled_class_repetitions` count as one position.
+  absl::StatusOr<size_t> CountPositions(ASTNode const& node,
+                                        int max_unrolled_class_repetitions) const;
+
+  // Parses the pattern into `ast_`, simplifies it, and checks it against the limits on its size
+  // with `CountPositions`, storing the result in `num_positions_`.
+  absl::Status BuildAST();
+
+  // An automaton built from `ast_`, and the same automaton with its counters unrolled as far as
+  // the limits on the size of the pattern allow, if it has any. `Finalize` picks the latter if it
+  // can be run by the `DFA` (see `Flags::max_unrolled_class_repetitions`).
+  struct NFAs {
+    void AllowAnyPrefix() {
+      counted.AllowAnyPrefix();
+      if (unrolled.has_value()) {
+        unrolled->AllowAnyPrefix();
+      }
+    }
+
+    void Reverse() {
+      counted.Reverse();
+      if (unrolled.has_value()) {
+        unrolled->Reverse();
+      }
+    }
+
+    TempNFA counted;
+    std::optional<TempNFA> unrolled;
+  };
+
+  // Builds an automaton from `ast_` with the construction selected in `flags`.
+  TempNFA BuildNFA(Flags const& flags);
+
+  // Builds both automata of `NFAs` from `ast_`.
+  NFAs BuildNFAs();
+
+  // Finalizes one of `nfas` as described in `NFAs`. See `TempNFA::Finalize` for `prefix_free`.
+  std::unique_ptr<AutomatonInterface> Finalize(NFAs nfas, bool* prefix_free = nullptr);
 
   std::string_view pattern_;
-  int32_t next_state_ = 0;
+  Flags const& flags_;
+  std::pmr::memory_resource* const resource_;
+
+  // Backs the syntax tree and the `TempNFA` and its scratch data structures, which make many small
+  // allocations that are short-lived. Freed blocks are recycled, and all the memory is returned at
+  // once when the parser is destroyed.
+  std::pmr::unsynchronized_pool_resource arena_;
+
+  AST ast_;
+
+  // The number of positions of `ast_`, as counted by `BuildAST`.
+  size_t num_positions_ = 0;
 };
 
 absl::StatusOr<int> Parser::ParseHexDigit(int const ch) {
@@ -105,62 +214,73 @@ absl::StatusOr<int> Parser::ParseHexCode() {
   return status_or_digit1.value() * 16 + status_or_digit2.value();
 }
 
-TempNFA Parser::MakeSingleCharacterNFA(int const ch) {
-  int const start = next_state_++;
-  int const stop = next_state_++;
-  return TempNFA(
-      {
-          {start, MakeState({{ch, {stop}}})},
-          {stop, MakeState({})},
-      },
-      start, stop);
+std::bitset<256> Parser::MakeCharacterSet(std::string_view const chars) {
+  std::bitset<256> char_set;
+  for (uint8_t const ch : chars) {
+    char_set.set(ch);
+  }
+  return char_set;
 }
 
-TempNFA Parser::MakeCharacterClassNFA(std::string_view const chars) {
-  int const start = next_state_++;
-  int const stop = next_state_++;
-  State state;
-  for (uint8_t const ch : chars) {
-    state[ch].emplace_back(stop);
-  }
-  return TempNFA(
-      {
-          {start, std::move(state)},
-          {stop, MakeState({})},
-      },
-      start, stop);
+std::bitset<256> Parser::MakeCharacterRange(uint8_t const first, uint8_t const last) {
+  auto const all = ~std::bitset<256>();
+  return (all << first) & (all >> (255 - last));
 }
 
-TempNFA Parser::MakeNegatedCharacterClassNFA(std::string_view const chars) {
-  int const start = next_state_++;
-  int const stop = next_state_++;
-  State state;
-  for (int ch = 1; ch < 256; ++ch) {
-    state[ch].emplace_back(stop);
-  }
-  for (uint8_t const ch : chars) {
-    state[ch].clear();
-  }
-  return TempNFA(
-      {
-          {start, std::move(state)},
-          {stop, MakeState({})},
-      },
-      start, stop);
+ASTNode* Parser::MakeSingleCharacter(uint8_t const ch) {
+  return ast_.MakeCharacterClass(std::bitset<256>().set(ch));
 }
 
-absl::Status Parser::UpdateCharacterClassEdge(bool const negated, State* const start_state,
-                                              uint8_t const ch, int const stop_state_num) {
-  if (negated) {
-    (*start_state)[ch].clear();
+ASTNode* Parser::MakeCharacterClass(std::string_view const chars) {
+  return ast_.MakeCharacterClass(MakeCharacterSet(chars));
+}
+
+ASTNode* Parser::MakeNegatedCharacterClass(std::string_view const chars) {
+  return ast_.MakeCharacterClass(~MakeCharacterSet(chars));
+}
+
+ASTNode* Parser::MakeSequence(std::vector<ASTNode*> const& pieces) {
+  if (pieces.empty()) {
+    return ast_.MakeEmpty();
+  } else if (pieces.size() == 1) {
+    return pieces[0];
   } else {
-    (*start_state)[ch].emplace_back(stop_state_num);
+    return ast_.MakeConcatenation(pieces);
   }
-  return absl::OkStatus();
 }
 
-absl::Status Parser::ParseCharacterClassEscapeCode(bool const negated, State* const start_state,
-                                                   int const stop_state_num) {
+std::optional<std::bitset<256>> Parser::ParseCharacterClassShorthand() {
+  if (pattern_.size() < 2 || pattern_[0] != '\\') {
+    return std::nullopt;
+  }
+  std::bitset<256> chars;
+  switch (pattern_[1]) {
+    case 'd':
+      chars = MakeCharacterSet(kDigits);
+      break;
+    case 'D':
+      chars = ~MakeCharacterSet(kDigits);
+      break;
+    case 'w':
+      chars = MakeCharacterSet(kWordCharacters);
+      break;
+    case 'W':
+      chars = ~MakeCharacterSet(kWordCharacters);
+      break;
+    case 's':
+      chars = MakeCharacterSet(kSpaces);
+      break;
+    case 'S':
+      chars = ~MakeCharacterSet(kSpaces);
+      break;
+    default:
+      return std::nullopt;
+  }
+  pattern_.remove_prefix(2);
+  return chars;
+}
+
+absl::StatusOr<uint8_t> Parser::ParseCharacterClassEscapeCode() {
   if (pattern_.empty()) {
     return absl::InvalidArgumentError("invalid escape code");
   }
@@ -178,25 +298,26 @@ absl::Status Parser::ParseCharacterClassEscapeCode(bool const negated, State* co
     case '{':
     case '}':
     case '|':
-      return UpdateCharacterClassEdge(negated, start_state, ch, stop_state_num);
+    case '-':
+      return ch;
     case 't':
-      return UpdateCharacterClassEdge(negated, start_state, '\t', stop_state_num);
+      return '\t';
     case 'r':
-      return UpdateCharacterClassEdge(negated, start_state, '\r', stop_state_num);
+      return '\r';
     case 'n':
-      return UpdateCharacterClassEdge(negated, start_state, '\n', stop_state_num);
+      return '\n';
     case 'v':
-      return UpdateCharacterClassEdge(negated, start_state, '\v', stop_state_num);
+      return '\v';
     case 'f':
-      return UpdateCharacterClassEdge(negated, start_state, '\f', stop_state_num);
+      return '\f';
     case 'b':
-      return UpdateCharacterClassEdge(negated, start_state, '\b', stop_state_num);
+      return '\b';
     case 'x': {
       auto status_or_code = ParseHexCode();
       if (!status_or_code.ok()) {
         return std::move(status_or_code).status();
       }
-      return UpdateCharacterClassEdge(negated, start_state, status_or_code.value(), stop_state_num);
+      return status_or_code.value();
     }
     case '0':
     case '1':
@@ -214,60 +335,67 @@ absl::Status Parser::ParseCharacterClassEscapeCode(bool const negated, State* co
   }
 }
 
-absl::StatusOr<TempNFA> Parser::ParseCharacterClass() {
+absl::StatusOr<uint8_t> Parser::ParseCharacterClassCharacter() {
+  if (absl::ConsumePrefix(&pattern_, "\\")) {
+    return ParseCharacterClassEscapeCode();
+  }
+  uint8_t const ch = pattern_[0];
+  pattern_.remove_prefix(1);
+  return ch;
+}
+
+absl::StatusOr<ASTNode*> Parser::ParseCharacterClass() {
   if (!absl::ConsumePrefix(&pattern_, "[")) {
     return absl::InvalidArgumentError("expected [");
   }
-  int const start = next_state_++;
-  int const stop = next_state_++;
-  State state;
+  // The characters are accumulated as a plain set and complemented at the end if the class is
+  // negated.
+  std::bitset<256> chars;
   bool const negated = absl::ConsumePrefix(&pattern_, "^");
-  if (negated) {
-    for (int ch = 1; ch < 256; ++ch) {
-      state[ch].emplace_back(stop);
-    }
-  }
   while (!absl::ConsumePrefix(&pattern_, "]")) {
     if (pattern_.empty()) {
       return absl::InvalidArgumentError("unmatched square bracket");
     }
-    if (absl::ConsumePrefix(&pattern_, "\\")) {
-      auto const status = ParseCharacterClassEscapeCode(negated, &state, stop);
-      if (!status.ok()) {
-        return status;
-      }
-    } else {
-      uint8_t const ch1 = pattern_[0];
-      pattern_.remove_prefix(1);
-      if (pattern_.size() > 2 && pattern_[0] == '-' && pattern_[1] != ']') {
-        pattern_.remove_prefix(2);
-        // TODO: ranges
-        return absl::UnimplementedError("ranges in character classes");
-      } else {
-        if (negated) {
-          state[ch1].clear();
-        } else {
-          state[ch1].emplace_back(stop);
-        }
-      }
+    auto const maybe_shorthand = ParseCharacterClassShorthand();
+    if (maybe_shorthand.has_value()) {
+      chars |= maybe_shorthand.value();
+      continue;
     }
+    auto const status_or_first = ParseCharacterClassCharacter();
+    if (!status_or_first.ok()) {
+      return std::move(status_or_first).status();
+    }
+    uint8_t const first = status_or_first.value();
+    // A dash right before the closing bracket is a plain character.
+    if (pattern_.size() < 2 || pattern_[0] != '-' || pattern_[1] == ']') {
+      chars.set(first);
+      continue;
+    }
+    pattern_.remove_prefix(1);
+    auto const status_or_last = ParseCharacterClassCharacter();
+    if (!status_or_last.ok()) {
+      return std::move(status_or_last).status();
+    }
+    uint8_t const last = status_or_last.value();
+    if (last < first) {
+      return absl::InvalidArgumentError("invalid range in character class");
+    }
+    chars |= MakeCharacterRange(first, last);
   }
-  return TempNFA(
-      {
-          {start, std::move(state)},
-          {stop, {}},
-      },
-      start, stop);
+  if (negated) {
+    chars.flip();
+  }
+  return ast_.MakeCharacterClass(chars);
 }
 
-absl::StatusOr<TempNFA> Parser::ParseEscape() {
+absl::StatusOr<ASTNode*> Parser::ParseEscape() {
   if (!absl::ConsumePrefix(&pattern_, "\\")) {
     return absl::InvalidArgumentError("expected \\");
   }
   if (pattern_.empty()) {
     return absl::InvalidArgumentError("invalid escape code");
   }
-  int const ch = pattern_[0];
+  uint8_t const ch = pattern_[0];
   pattern_.remove_prefix(1);
   switch (ch) {
     case '\\':
@@ -281,40 +409,36 @@ absl::StatusOr<TempNFA> Parser::ParseEscape() {
     case '{':
     case '}':
     case '|':
-      return MakeSingleCharacterNFA(ch);
+      return MakeSingleCharacter(ch);
     case 'd':
-      return MakeCharacterClassNFA("0123456789");
+      return MakeCharacterClass(kDigits);
     case 'D':
-      return MakeNegatedCharacterClassNFA("0123456789");
+      return MakeNegatedCharacterClass(kDigits);
     case 'w':
-      return MakeCharacterClassNFA(
-          "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+      return MakeCharacterClass(kWordCharacters);
     case 'W':
-      return MakeNegatedCharacterClassNFA(
-          "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+      return MakeNegatedCharacterClass(kWordCharacters);
     case 's':
-      // TODO: add Unicode spaces.
-      return MakeCharacterClassNFA("\f\n\r\t\v");
+      return MakeCharacterClass(kSpaces);
     case 'S':
-      // TODO: add Unicode spaces.
-      return MakeNegatedCharacterClassNFA("\f\n\r\t\v");
+      return MakeNegatedCharacterClass(kSpaces);
     case 't':
-      return MakeSingleCharacterNFA('\t');
+      return MakeSingleCharacter('\t');
     case 'r':
-      return MakeSingleCharacterNFA('\r');
+      return MakeSingleCharacter('\r');
     case 'n':
-      return MakeSingleCharacterNFA('\n');
+      return MakeSingleCharacter('\n');
     case 'v':
-      return MakeSingleCharacterNFA('\v');
+      return MakeSingleCharacter('\v');
     case 'f':
-      return MakeSingleCharacterNFA('\f');
+      return MakeSingleCharacter('\f');
       // TODO: handle word boundary (`\b`).
     case 'x': {
       auto status_or_code = ParseHexCode();
       if (!status_or_code.ok()) {
         return std::move(status_or_code).status();
       }
-      return MakeSingleCharacterNFA(status_or_code.value());
+      return MakeSingleCharacter(status_or_code.value());
     }
     // TODO: handle Unicode escape codes.
     case '0':
@@ -333,39 +457,12 @@ absl::StatusOr<TempNFA> Parser::ParseEscape() {
   }
 }
 
-absl::StatusOr<TempNFA> Parser::Parse0() {
-  int const start = next_state_++;
-  if (pattern_.empty()) {
-    return TempNFA({{start, MakeState({})}}, start, start);
-  }
-  if (absl::ConsumePrefix(&pattern_, "(")) {
-    auto result = Parse3();
-    if (!result.ok()) {
-      return std::move(result).status();
-    }
-    if (!absl::ConsumePrefix(&pattern_, ")")) {
-      return absl::InvalidArgumentError("unmatched parens");
-    }
-    return result;
-  }
-  int const stop = next_state_++;
+absl::StatusOr<ASTNode*> Parser::ParseAtom() {
   if (absl::ConsumePrefix(&pattern_, ".")) {
-    absl::flat_hash_map<uint8_t, absl::InlinedVector<int32_t, 1>> edges;
-    for (int ch = 1; ch < 256; ++ch) {
-      edges.try_emplace(ch, absl::InlinedVector<int32_t, 1>{stop});
-    }
-    return TempNFA(
-        {
-            {start, MakeState(std::move(edges))},
-            {stop, {}},
-        },
-        start, stop);
-  }
-  int const ch = pattern_[0];
+    return ast_.MakeCharacterClass(std::bitset<256>().set());
+  }
+  uint8_t const ch = pattern_[0];
   switch (ch) {
-    case ')':
-    case '|':
-      return TempNFA({{start, MakeState({})}}, start, start);
     case '[':
       return ParseCharacterClass();
     case ']':
@@ -385,12 +482,7 @@ absl::StatusOr<TempNFA> Parser::Parse0() {
       return absl::InvalidArgumentError("anchors are disallowed in this position");
     default:
       pattern_.remove_prefix(1);
-      return TempNFA(
-          {
-              {start, MakeState({{ch, {stop}}})},
-              {stop, {}},
-          },
-          start, stop);
+      return MakeSingleCharacter(ch);
   }
 }
 
@@ -409,7 +501,7 @@ absl::StatusOr<std::pair<int, int>> Parser::ParseQuantifier() {
       min = min * 10 + (pattern_[0] - '0');
       if (min > kMaxNumericQuantifier) {
         return absl::InvalidArgumentError(
-            "numeric quantifiers greater than 1000 are not supported");
+            "numeric quantifiers greater than 100000 are not supported");
       }
       pattern_.remove_prefix(1);
     }
@@ -434,7 +526,7 @@ absl::StatusOr<std::pair<int, int>> Parser::ParseQuantifier() {
       max = max * 10 + (pattern_[0] - '0');
       if (max > kMaxNumericQuantifier) {
         return absl::InvalidArgumentError(
-            "numeric quantifiers greater than 1000 are not supported");
+            "numeric quantifiers greater than 100000 are not supported");
       }
       pattern_.remove_prefix(1);
     }
@@ -446,21 +538,13 @@ absl::StatusOr<std::pair<int, int>> Parser::ParseQuantifier() {
   }
 }
 
-absl::StatusOr<TempNFA> Parser::Parse1() {
-  auto status_or_nfa = Parse0();
-  if (!status_or_nfa.ok()) {
-    return status_or_nfa;
-  }
-  auto nfa = std::move(status_or_nfa).value();
-  if (pattern_.empty()) {
-    return nfa;
-  }
+absl::StatusOr<ASTNode*> Parser::ParseRepetition(ASTNode* const node) {
   if (absl::ConsumePrefix(&pattern_, "*")) {
-    nfa.RenameState(nfa.initial_state(), nfa.final_state());
+    return ast_.MakeRepetition(node, 0, -1);
   } else if (absl::ConsumePrefix(&pattern_, "+")) {
-    nfa.AddEdge(0, nfa.final_state(), nfa.initial_state());
+    return ast_.MakeRepetition(node, 1, -1);
   } else if (absl::ConsumePrefix(&pattern_, "?")) {
-    nfa.AddEdge(0, nfa.initial_state(), nfa.final_state());
+    return ast_.MakeRepetition(node, 0, 1);
   } else if (absl::ConsumePrefix(&pattern_, "{")) {
     auto const status_or_quantifier = ParseQuantifier();
     if (!status_or_quantifier.ok()) {
@@ -471,86 +555,214 @@ absl::StatusOr<TempNFA> Parser::Parse1() {
       if (max >= 0) {
         return absl::InvalidArgumentError("invalid quantifier");
       }
-      nfa.RenameState(nfa.initial_state(), nfa.final_state());
-    } else {
-      auto piece = std::move(nfa);
-      int const start = next_state_++;
-      nfa = TempNFA({{start, MakeState({})}}, start, start);
-      for (int i = 0; i < min; ++i) {
-        piece.RenameAllStates(&next_state_);
-        nfa.Chain(piece);
+      return ast_.MakeRepetition(node, 0, -1);
+    }
+    if (max >= 0 && max < min) {
+      return absl::InvalidArgumentError("invalid quantifier");
+    }
+    return ast_.MakeRepetition(node, min, max);
+  }
+  return node;
+}
+
+absl::Status Parser::ParseAST() {
+  // The round brackets that are currently open, innermost last, preceded by the whole pattern. Each
+  // has the branches of its alternation parsed so far and the pieces of the current branch.
+  struct Group {
+    std::vector<ASTNode*> branches;
+    std::vector<ASTNode*> pieces;
+  };
+  std::vector<Group> groups(1);
+  auto const end_branch = [&] {
+    auto& group = groups.back();
+    group.branches.push_back(MakeSequence(group.pieces));
+    group.pieces.clear();
+  };
+  auto const end_group = [&] {
+    end_branch();
+    auto branches = std::move(groups.back().branches);
+    groups.pop_back();
+    return branches.size() > 1 ? ast_.MakeAlternation(branches) : branches[0];
+  };
+  while (!pattern_.empty()) {
+    ASTNode* atom;
+    if (absl::ConsumePrefix(&pattern_, "(")) {
+      if (groups.size() > kMaxNestingDepth) {
+        return absl::InvalidArgumentError("parens nested too deeply");
       }
-      if (max < 0) {
-        piece.RenameState(piece.initial_state(), piece.final_state());
-        piece.RenameAllStates(&next_state_);
-        nfa.Chain(std::move(piece));
-      } else {
-        if (max < min) {
-          return absl::InvalidArgumentError("invalid quantifier");
-        }
-        piece.AddEdge(0, piece.initial_state(), piece.final_state());
-        for (int i = min; i < max; ++i) {
-          piece.RenameAllStates(&next_state_);
-          nfa.Chain(piece);
-        }
+      groups.emplace_back();
+      continue;
+    } else if (absl::ConsumePrefix(&pattern_, "|")) {
+      end_branch();
+      continue;
+    } else if (absl::ConsumePrefix(&pattern_, ")")) {
+      if (groups.size() < 2) {
+        return absl::InvalidArgumentError("unmatched parens");
+      }
+      atom = end_group();
+    } else {
+      auto const status_or_atom = ParseAtom();
+      if (!status_or_atom.ok()) {
+        return status_or_atom.status();
       }
+      atom = status_or_atom.value();
+    }
+    auto const status_or_piece = ParseRepetition(atom);
+    if (!status_or_piece.ok()) {
+      return status_or_piece.status();
     }
+    groups.back().pieces.push_back(status_or_piece.value());
   }
-  return nfa;
+  if (groups.size() > 1) {
+    return absl::InvalidArgumentError("unmatched parens");
+  }
+  ast_.set_root(end_group());
+  return absl::OkStatus();
 }
 
-absl::StatusOr<TempNFA> Parser::Parse2() {
-  auto status_or_nfa = Parse1();
-  if (!status_or_nfa.ok()) {
-    return status_or_nfa;
+absl::Status Parser::BuildAST() {
+  auto const status = ParseAST();
+  if (!status.ok()) {
+    return status;
   }
-  auto nfa = std::move(status_or_nfa).value();
-  while (!pattern_.empty() && pattern_[0] != '|' && pattern_[0] != ')') {
-    status_or_nfa = Parse1();
-    if (!status_or_nfa.ok()) {
-      return status_or_nfa;
-    }
-    nfa.Chain(std::move(status_or_nfa).value());
+  SimplifyAST(&ast_);
+  auto const status_or_positions =
+      CountPositions(*ast_.root(), flags_.max_unrolled_class_repetitions);
+  if (!status_or_positions.ok()) {
+    return status_or_positions.status();
   }
-  return nfa;
+  num_positions_ = status_or_positions.value();
+  return absl::OkStatus();
 }
 
-absl::StatusOr<TempNFA> Parser::Parse3() {
-  auto status_or_nfa = Parse2();
-  if (!status_or_nfa.ok()) {
-    return status_or_nfa;
+absl::StatusOr<std::unique_ptr<AutomatonInterface>> Parser::Parse() {
+  auto const status = BuildAST();
+  if (!status.ok()) {
+    return status;
   }
-  auto nfa = std::move(status_or_nfa).value();
-  while (!pattern_.empty() && pattern_[0] != ')') {
-    if (!absl::ConsumePrefix(&pattern_, "|")) {
-      return absl::InvalidArgumentError("expected pipe operator");
-    }
-    status_or_nfa = Parse2();
-    if (!status_or_nfa.ok()) {
-      return status_or_nfa;
+  return Finalize(BuildNFAs());
+}
+
+absl::StatusOr<Automata> Parser::Compile() {
+  auto const status = BuildAST();
+  if (!status.ok()) {
+    return status;
+  }
+  Automata automata;
+  auto nfa = BuildNFAs();
+  if (!flags_.full_match) {
+    automata.prefilter = BuildPrefilter(*ast_.root());
+    // The other automata are derived from copies of the anchored one rather than built again from
+    // the syntax tree.
+    auto unanchored = nfa;
+    unanchored.AllowAnyPrefix();
+    automata.unanchored = Finalize(std::move(unanchored));
+    auto reverse = nfa;
+    reverse.Reverse();
+    auto reverse_unanchored = reverse;
+    reverse_unanchored.AllowAnyPrefix();
+    automata.reverse = Finalize(std::move(reverse));
+    automata.reverse_unanchored = Finalize(std::move(reverse_unanchored));
+  }
+  // Prefix-freeness is only used by searches.
+  automata.anchored =
+      Finalize(std::move(nfa), flags_.full_match ? nullptr : &automata.prefix_free);
+  return automata;
+}
+
+absl::StatusOr<size_t> Parser::CountPositions(ASTNode const& node,
+                                              int const max_unrolled_class_repetitions) const {
+  size_t positions = 0;
+  switch (node.kind) {
+    case ASTNode::Kind::kEmpty:
+      break;
+    case ASTNode::Kind::kCharacterClass:
+      positions = 1;
+      break;
+    case ASTNode::Kind::kConcatenation:
+    case ASTNode::Kind::kAlternation:
+      for (auto const child : node.children) {
+        auto const status_or_positions = CountPositions(*child, max_unrolled_class_repetitions);
+        if (!status_or_positions.ok()) {
+          return status_or_positions.status();
+        }
+        positions += status_or_positions.value();
+      }
+      break;
+    case ASTNode::Kind::kRepetition: {
+      auto const& child = *node.children[0];
+      auto const status_or_positions = CountPositions(child, max_unrolled_class_repetitions);
+      if (!status_or_positions.ok()) {
+        return status_or_positions.status();
+      }
+      int const bound = std::max(node.min, node.max);
+      // Same test as the automaton constructions.
+      if (bound > max_unrolled_class_repetitions &&
+          child.kind == ASTNode::Kind::kCharacterClass) {
+        positions = status_or_positions.value();
+        break;
+      }
+      if (bound > kMaxUnrolledRepetitions) {
+        return absl::InvalidArgumentError(
+            "repeating anything but a single character or character class more than 1000 times "
+            "is not supported");
+      }
+      // Neither factor exceeds its limit, so the product can't overflow.
+      positions = status_or_positions.value() * std::max(bound, 1);
+      break;
     }
-    int const initial_state = next_state_++;
-    int const final_state = next_state_++;
-    nfa.Merge(std::move(status_or_nfa).value(), initial_state, final_state);
   }
-  return nfa;
+  if (positions > kMaxPositions) {
+    return absl::InvalidArgumentError("the pattern is too large");
+  }
+  return positions;
 }
 
-absl::StatusOr<std::unique_ptr<AutomatonInterface>> Parser::Parse() {
-  auto status_or_nfa = Parse3();
-  if (!status_or_nfa.ok()) {
-    return std::move(status_or_nfa).status();
-  }
-  if (!pattern_.empty()) {
-    return absl::InvalidArgumentError("expected end of string");
+TempNFA Parser::BuildNFA(Flags const& flags) {
+  auto const& root = *ast_.root();
+  auto const construction = force_construction_for_testing.value_or(flags.construction);
+  return construction == Flags::Construction::kGlushkov ? BuildGlushkovNFA(root, flags, &arena_)
+                                                        : BuildThompsonNFA(root, flags, &arena_);
+}
+
+Parser::NFAs Parser::BuildNFAs() {
+  NFAs nfas{BuildNFA(flags_), std::nullopt};
+  // Class repetitions are unrolled up to the same bound as the others. Unrolling a counter adds
+  // positions, so the counts differ iff there's any left to unroll.
+  Flags unrolled_flags = flags_;
+  unrolled_flags.max_unrolled_class_repetitions =
+      std::max(flags_.max_unrolled_class_repetitions, kMaxUnrolledRepetitions);
+  auto const status_or_positions =
+      CountPositions(*ast_.root(), unrolled_flags.max_unrolled_class_repetitions);
+  if (status_or_positions.ok() && status_or_positions.value() > num_positions_) {
+    nfas.unrolled = BuildNFA(unrolled_flags);
+  }
+  return nfas;
+}
+
+std::unique_ptr<AutomatonInterface> Parser::Finalize(NFAs nfas, bool* const prefix_free) {
+  if (nfas.unrolled.has_value()) {
+    auto automaton =
+        std::move(nfas.unrolled).value().FinalizeIfDeterminizable(flags_, resource_, prefix_free);
+    if (automaton) {
+      return automaton;
+    }
   }
-  return std::move(status_or_nfa).value().Finalize();
+  return std::move(nfas.counted).Finalize(flags_, resource_, prefix_free);
 }
 
 }  // namespace
 
-absl::StatusOr<std::unique_ptr<AutomatonInterface>> Parse(std::string_view const pattern) {
-  return Parser(pattern).Parse();
+std::optional<Flags::Construction> force_construction_for_testing = std::nullopt;
+
+absl::StatusOr<std::unique_ptr<AutomatonInterface>> Parse(
+    std::string_view const pattern, Flags const& flags, std::pmr::memory_resource* const resource) {
+  return Parser(pattern, flags, resource).Parse();
+}
+
+absl::StatusOr<Automata> Compile(std::string_view const pattern, Flags const& flags,
+                                 std::pmr::memory_resource* const resource) {
+  return Parser(pattern, flags, resource).Compile();
 }
 
 }  // namespace re3
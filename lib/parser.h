@@ -2,17 +2,67 @@
 #define __RE3_LIB_PARSER_H__
 
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string_view>
 
 #include "absl/status/statusor.h"
 #include "lib/automaton.h"
+#include "lib/flags.h"
+#include "lib/prefilter.h"
 
 namespace re3 {
 
-// Parses a regular expression and compiles it into a runnable automaton. The automaton is initially
-// an `NFA` but it's automatically converted to a `DFA` if it's found to be deterministic. That is
-// because DFAs run faster.
-absl::StatusOr<std::unique_ptr<AutomatonInterface>> Parse(std::string_view pattern);
+// TESTS ONLY: forces `Parse` to use the specified construction regardless of the flags. Defaults to
+// `std::nullopt`, in which case `Parse` uses the one specified by `Flags::construction`.
+extern std::optional<Flags::Construction> force_construction_for_testing;
+
+// Parses a regular expression and compiles it into a runnable automaton, picking the fastest engine
+// that can run it (see `TempNFA::Finalize`). Automata with counters are run by a `CountingNFA`. The
+// others are turned into a `DFA`, determinizing them ahead of time if needed, unless the DFA would
+// exceed the size limit in the flags. In that case they're run by the bit-parallel `ShiftAnd`
+// engine if they have few enough positions, or else by a `LazyDFA`, which determinizes them on the
+// fly, or by a plain `NFA` if the flags disable the `LazyDFA`.
+//
+// The tables of the automaton are allocated from `resource`, which must outlive it.
+absl::StatusOr<std::unique_ptr<AutomatonInterface>> Parse(
+    std::string_view pattern, Flags const& flags = {},
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+// The automata compiled from a pattern by `Compile`.
+struct Automata {
+  // Recognizes the strings matching the pattern, i.e. the automaton returned by `Parse`.
+  std::unique_ptr<AutomatonInterface> anchored;
+
+  // Recognizes the strings that end with a match of the pattern (see `TempNFA::AllowAnyPrefix`), so
+  // that its shortest accepted prefix ends where the earliest match ends. Null if
+  // `Flags::full_match` is set, since full matches don't need it.
+  std::unique_ptr<AutomatonInterface> unanchored;
+
+  // Recognizes the reversals of the strings matching the pattern (see `TempNFA::Reverse`), so that
+  // its accepted suffixes are the matches ending at the end of the input. Null if
+  // `Flags::full_match` is set.
+  std::unique_ptr<AutomatonInterface> reverse;
+
+  // Like `reverse`, but unanchored: its shortest accepted suffix starts where the last match of the
+  // pattern in the input starts. Null if `Flags::full_match` is set.
+  std::unique_ptr<AutomatonInterface> reverse_unanchored;
+
+  // True if no match of the pattern is a proper prefix of another one (see `TempNFA::Finalize`),
+  // so that every match ends as soon as it can and the matches found by a search can be counted
+  // from their ends alone. Always false if `Flags::full_match` is set, since only searches use it.
+  bool prefix_free = false;
+
+  // Skips to the positions where a match can start (see `BuildPrefilter`). Empty if
+  // `Flags::full_match` is set.
+  Prefilter prefilter;
+};
+
+// Parses a regular expression like `Parse` and compiles it into all the automata needed to search
+// for it.
+absl::StatusOr<Automata> Compile(
+    std::string_view pattern, Flags const& flags = {},
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 
 }  // namespace re3
 
@@ -0,0 +1,206 @@
+#include "lib/prefilter.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "lib/ast.h"
+
+namespace re3 {
+
+namespace {
+
+// A literal that all the strings matched by a node begin with. If `exact` is true the node matches
+// the literal and nothing else, so the literal can be extended with whatever follows the node.
+struct LiteralPrefix {
+  std::string chars;
+  bool exact;
+};
+
+bool IsNullable(ASTNode const &node) {
+  switch (node.kind) {
+    case ASTNode::Kind::kEmpty:
+      return true;
+    case ASTNode::Kind::kCharacterClass:
+      return false;
+    case ASTNode::Kind::kConcatenation:
+      return std::all_of(node.children.begin(), node.children.end(),
+                         [](ASTNode const *const child) { return IsNullable(*child); });
+    case ASTNode::Kind::kAlternation:
+      return std::any_of(node.children.begin(), node.children.end(),
+                         [](ASTNode const *const child) { return IsNullable(*child); });
+    case ASTNode::Kind::kRepetition:
+      return node.min == 0 || IsNullable(*node.children[0]);
+  }
+  return false;
+}
+
+std::bitset<256> GetFirstBytes(ASTNode const &node) {
+  switch (node.kind) {
+    case ASTNode::Kind::kEmpty:
+      return {};
+    case ASTNode::Kind::kCharacterClass:
+      return node.chars;
+    case ASTNode::Kind::kConcatenation: {
+      // The first byte may come from any prefix of nullable children and the first child that
+      // isn't nullable.
+      std::bitset<256> first_bytes;
+      for (auto const child : node.children) {
+        first_bytes |= GetFirstBytes(*child);
+        if (!IsNullable(*child)) {
+          break;
+        }
+      }
+      return first_bytes;
+    }
+    case ASTNode::Kind::kAlternation: {
+      std::bitset<256> first_bytes;
+      for (auto const child : node.children) {
+        first_bytes |= GetFirstBytes(*child);
+      }
+      return first_bytes;
+    }
+    case ASTNode::Kind::kRepetition:
+      return node.max == 0 ? std::bitset<256>() : GetFirstBytes(*node.children[0]);
+  }
+  return {};
+}
+
+// Truncates `prefix` to the length looked for by the prefilter. A truncated prefix isn't exact
+// anymore.
+void Truncate(LiteralPrefix *const prefix) {
+  if (prefix->chars.size() > Prefilter::kMaxLiteralLength) {
+    prefix->chars.resize(Prefilter::kMaxLiteralLength);
+    prefix->exact = false;
+  }
+}
+
+LiteralPrefix GetLiteralPrefix(ASTNode const &node) {
+  switch (node.kind) {
+    case ASTNode::Kind::kEmpty:
+      return {"", /*exact=*/true};
+    case ASTNode::Kind::kCharacterClass:
+      if (node.chars.count() != 1) {
+        return {"", /*exact=*/false};
+      }
+      for (int ch = 0; ch < 256; ++ch) {
+        if (node.chars[ch]) {
+          return {std::string(1, ch), /*exact=*/true};
+        }
+      }
+      break;
+    case ASTNode::Kind::kConcatenation: {
+      LiteralPrefix prefix{"", /*exact=*/true};
+      for (auto const child : node.children) {
+        if (!prefix.exact) {
+          break;
+        }
+        auto const child_prefix = GetLiteralPrefix(*child);
+        prefix.chars += child_prefix.chars;
+        prefix.exact = child_prefix.exact;
+        Truncate(&prefix);
+      }
+      return prefix;
+    }
+    case ASTNode::Kind::kAlternation: {
+      // Keep the longest common prefix of all branches.
+      auto prefix = GetLiteralPrefix(*node.children[0]);
+      for (size_t i = 1; i < node.children.size(); ++i) {
+        auto const branch_prefix = GetLiteralPrefix(*node.children[i]);
+        prefix.exact = prefix.exact && branch_prefix.exact && prefix.chars == branch_prefix.chars;
+        auto const [it, unused] = std::mismatch(prefix.chars.begin(), prefix.chars.end(),
+                                                branch_prefix.chars.begin(),
+                                                branch_prefix.chars.end());
+        prefix.chars.erase(it, prefix.chars.end());
+      }
+      return prefix;
+    }
+    case ASTNode::Kind::kRepetition: {
+      if (node.min == 0) {
+        return {"", /*exact=*/node.max == 0};
+      }
+      auto const child_prefix = GetLiteralPrefix(*node.children[0]);
+      if (!child_prefix.exact) {
+        return child_prefix;
+      }
+      LiteralPrefix prefix{"", /*exact=*/node.min == node.max};
+      for (int i = 0; i < node.min && prefix.chars.size() <= Prefilter::kMaxLiteralLength; ++i) {
+        prefix.chars += child_prefix.chars;
+      }
+      if (prefix.chars.size() < child_prefix.chars.size() * node.min) {
+        prefix.exact = false;
+      }
+      Truncate(&prefix);
+      return prefix;
+    }
+  }
+  return {"", /*exact=*/false};
+}
+
+}  // namespace
+
+Prefilter::Prefilter(std::string_view const literal, std::bitset<256> const &first_bytes) {
+  if (!literal.empty()) {
+    literal_length_ = std::min<size_t>(literal.size(), kMaxLiteralLength);
+    std::copy_n(literal.begin(), literal_length_, literal_.begin());
+  } else if (first_bytes.count() <= kMaxFirstBytes) {
+    for (int ch = 0; ch < 256; ++ch) {
+      if (first_bytes[ch]) {
+        first_bytes_[num_first_bytes_++] = ch;
+      }
+    }
+  }
+}
+
+size_t Prefilter::FindCandidate(std::string_view const input, size_t position) const {
+  if (literal_length_ > 0) {
+    // Look for the first character of the literal and check the rest wherever it's found.
+    auto const literal = this->literal();
+    while (input.size() - position >= literal.size()) {
+      auto const found = static_cast<char const *>(std::memchr(
+          input.data() + position, literal[0], input.size() - position - literal.size() + 1));
+      if (found == nullptr) {
+        return std::string_view::npos;
+      }
+      position = found - input.data();
+      if (std::memcmp(found + 1, literal.data() + 1, literal.size() - 1) == 0) {
+        return position;
+      }
+      ++position;
+    }
+    return std::string_view::npos;
+  }
+  if (num_first_bytes_ == 0) {
+    return position;
+  }
+  if (position == input.size()) {
+    return std::string_view::npos;
+  }
+  // Look for every byte in turn, each time only up to the closest occurrence found so far.
+  size_t end = input.size();
+  for (int i = 0; i < num_first_bytes_; ++i) {
+    auto const found = static_cast<char const *>(
+        std::memchr(input.data() + position, first_bytes_[i], end - position));
+    if (found != nullptr) {
+      end = found - input.data();
+    }
+  }
+  return end < input.size() ? end : std::string_view::npos;
+}
+
+Prefilter BuildPrefilter(ASTNode const &root) {
+  if (IsNullable(root)) {
+    return Prefilter();
+  }
+  auto const prefix = GetLiteralPrefix(root);
+  if (!prefix.chars.empty()) {
+    return Prefilter(prefix.chars, std::bitset<256>());
+  } else {
+    return Prefilter("", GetFirstBytes(root));
+  }
+}
+
+}  // namespace re3
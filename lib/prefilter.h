@@ -0,0 +1,66 @@
+#ifndef __RE3_LIB_PREFILTER_H__
+#define __RE3_LIB_PREFILTER_H__
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "lib/ast.h"
+
+namespace re3 {
+
+// Skips the parts of the input where no match can start, so that searches only run the automaton
+// from plausible starting positions.
+//
+// A prefilter looks either for a literal that every match begins with, or for a small set of bytes
+// that every match begins with one of. Both searches are done with `memchr`, which is vectorized
+// by the standard library and is much faster than stepping an automaton byte by byte.
+//
+// Prefilters don't allocate memory, so they're cheap to copy along with the automata.
+class Prefilter {
+ public:
+  // Maximum number of characters of the literal prefix that are looked for. Longer prefixes are
+  // truncated, which doesn't affect correctness and rarely yields more candidates.
+  static inline int constexpr kMaxLiteralLength = 32;
+
+  // Maximum number of distinct first bytes that are looked for. Larger sets take too many passes
+  // over the input to be worth it.
+  static inline int constexpr kMaxFirstBytes = 3;
+
+  // Builds a prefilter that doesn't skip anything.
+  explicit Prefilter() = default;
+
+  // Builds a prefilter that skips to the occurrences of `literal` if it's not empty, or else to the
+  // occurrences of the bytes in `first_bytes`. The prefilter doesn't skip anything if `literal` is
+  // empty and `first_bytes` has no elements or more than `kMaxFirstBytes`.
+  explicit Prefilter(std::string_view literal, std::bitset<256> const &first_bytes);
+
+  // Returns true iff the prefilter doesn't skip anything.
+  bool empty() const { return literal_length_ == 0 && num_first_bytes_ == 0; }
+
+  // The literal prefix looked for, which may be empty.
+  std::string_view literal() const { return std::string_view(literal_.data(), literal_length_); }
+
+  // Returns the first position at or after `position` where a match may start, or
+  // `std::string_view::npos` if there's none. `position` must not exceed `input.size()`.
+  size_t FindCandidate(std::string_view input, size_t position) const;
+
+ private:
+  std::array<char, kMaxLiteralLength> literal_{};
+  int literal_length_ = 0;
+
+  // The bytes looked for when there's no literal. Only the first `num_first_bytes_` are used.
+  std::array<uint8_t, kMaxFirstBytes> first_bytes_{};
+  int num_first_bytes_ = 0;
+};
+
+// Builds a prefilter for the strings matched by the tree rooted at `root`, looking for the literal
+// that every match begins with or, if there's none, for the set of bytes that every match begins
+// with. Patterns that match the empty string get an empty prefilter, since they match everywhere.
+Prefilter BuildPrefilter(ASTNode const &root);
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_PREFILTER_H__
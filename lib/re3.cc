@@ -1,28 +1,202 @@
 #include "lib/re3.h"
 
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <utility>
 #include <vector>
 
+#include "absl/functional/function_ref.h"
 #include "absl/status/statusor.h"
+#include "lib/automaton.h"
 #include "lib/parser.h"
+#include "lib/prefilter.h"
 
 namespace re3 {
 
-absl::StatusOr<RE> RE::Create(std::string_view const pattern, Flags const& flags) {
-  auto status_or_automaton = Parse(pattern);
-  if (status_or_automaton.ok()) {
-    return RE(std::move(status_or_automaton).value());
+namespace {
+
+std::unique_ptr<AutomatonInterface> CloneOrNull(
+    std::unique_ptr<AutomatonInterface> const& automaton) {
+  return automaton ? automaton->Clone() : nullptr;
+}
+
+size_t GetMemoryUsageOrZero(std::unique_ptr<AutomatonInterface> const& automaton) {
+  return automaton ? automaton->GetMemoryUsage() : 0;
+}
+
+}  // namespace
+
+absl::StatusOr<RE> RE::Create(std::string_view const pattern, Flags const& flags,
+                              std::pmr::memory_resource* const resource) {
+  auto status_or_automata = Compile(pattern, flags, resource);
+  if (status_or_automata.ok()) {
+    return RE(std::move(status_or_automata).value());
+  } else {
+    return std::move(status_or_automata).status();
+  }
+}
+
+RE& RE::operator=(RE const& other) {
+  automata_.anchored = other.automata_.anchored->Clone();
+  automata_.unanchored = CloneOrNull(other.automata_.unanchored);
+  automata_.reverse = CloneOrNull(other.automata_.reverse);
+  automata_.reverse_unanchored = CloneOrNull(other.automata_.reverse_unanchored);
+  automata_.prefix_free = other.automata_.prefix_free;
+  automata_.prefilter = other.automata_.prefilter;
+  return *this;
+}
+
+std::optional<std::string_view> RE::Find(std::string_view const input) const {
+  auto const& anchored = *automata_.anchored;
+  if (!automata_.unanchored) {
+    if (anchored.Run(input)) {
+      return input;
+    } else {
+      return std::nullopt;
+    }
+  }
+  auto const end = FindEarliestEnd(input, 0);
+  if (!end.has_value()) {
+    return std::nullopt;
+  }
+  // The leftmost start among the matches ending at `end` is where the longest of them starts.
+  auto const start =
+      *end - automata_.reverse->MatchSuffix(input.substr(0, *end), PrefixLength::kLongest).value();
+  auto const length = anchored.MatchPrefix(input.substr(start), PrefixLength::kLongest);
+  return input.substr(start, length.value());
+}
+
+std::optional<std::string_view> RE::FindLast(std::string_view const input) const {
+  if (!automata_.reverse_unanchored) {
+    return Find(input);
+  }
+  auto const length = automata_.reverse_unanchored->MatchSuffix(input, PrefixLength::kShortest);
+  if (!length.has_value()) {
+    return std::nullopt;
+  }
+  auto const start = input.size() - *length;
+  auto const match_length =
+      automata_.anchored->MatchPrefix(input.substr(start), PrefixLength::kLongest);
+  return input.substr(start, match_length.value());
+}
+
+void RE::FindAll(std::string_view const input,
+                 absl::FunctionRef<void(std::string_view)> const callback) const {
+  if (!automata_.unanchored) {
+    auto const match = Find(input);
+    if (match.has_value()) {
+      callback(*match);
+    }
+    return;
+  }
+  size_t position = 0;
+  std::optional<size_t> previous_end;
+  while (position <= input.size()) {
+    auto const match = Find(input.substr(position));
+    if (!match.has_value()) {
+      return;
+    }
+    size_t const start = match->data() - input.data();
+    size_t const end = start + match->size();
+    if (match->empty() && start == previous_end) {
+      // Skip empty matches right after the previous match, e.g. at the end of `aa` for `a*`.
+      position = start + 1;
+      continue;
+    }
+    callback(*match);
+    previous_end = end;
+    position = match->empty() ? end + 1 : end;
+  }
+}
+
+bool RE::IsMatch(std::string_view const input) const {
+  if (!automata_.unanchored) {
+    return automata_.anchored->Run(input);
+  }
+  return FindEarliestEnd(input, 0).has_value();
+}
+
+size_t RE::Count(std::string_view const input) const {
+  if (!automata_.unanchored) {
+    return automata_.anchored->Run(input) ? 1 : 0;
+  }
+  size_t count = 0;
+  if (automata_.prefix_free) {
+    // Each match found by `FindAll` ends where the unanchored automaton first accepts. The only
+    // prefix-free language with empty matches is the one with just the empty string, in which case
+    // there's a match at every position.
+    for (size_t position = 0; position <= input.size(); ++count) {
+      auto const end = FindEarliestEnd(input, position);
+      if (!end.has_value()) {
+        break;
+      }
+      position = std::max(*end, position + 1);
+    }
+  } else {
+    FindAll(input, [&](std::string_view) { ++count; });
+  }
+  return count;
+}
+
+std::vector<std::string_view> RE::Split(std::string_view const input) const {
+  std::vector<std::string_view> pieces;
+  size_t piece_start = 0;
+  FindAll(input, [&](std::string_view const match) {
+    size_t const match_start = match.data() - input.data();
+    pieces.push_back(input.substr(piece_start, match_start - piece_start));
+    piece_start = match_start + match.size();
+  });
+  pieces.push_back(input.substr(piece_start));
+  return pieces;
+}
+
+absl::StatusOr<std::vector<std::string>> RE::Match(std::string_view const input) const {
+  auto const match = Find(input);
+  if (match.has_value()) {
+    return std::vector<std::string>{std::string(*match)};
+  } else {
+    return std::vector<std::string>{};
+  }
+}
+
+absl::StatusOr<std::vector<std::string>> RE::MatchLast(std::string_view const input) const {
+  auto const match = FindLast(input);
+  if (match.has_value()) {
+    return std::vector<std::string>{std::string(*match)};
   } else {
-    return std::move(status_or_automaton).status();
+    return std::vector<std::string>{};
   }
 }
 
+std::optional<size_t> RE::FindEarliestEnd(std::string_view const input, size_t position) const {
+  // No match starts before the first candidate, so the unanchored automaton can start there.
+  position = automata_.prefilter.FindCandidate(input, position);
+  if (position == std::string_view::npos) {
+    return std::nullopt;
+  }
+  auto const end =
+      automata_.unanchored->MatchPrefix(input.substr(position), PrefixLength::kShortest);
+  if (!end.has_value()) {
+    return std::nullopt;
+  }
+  return position + *end;
+}
+
+size_t RE::GetMemoryUsage() const {
+  return automata_.anchored->GetMemoryUsage() + GetMemoryUsageOrZero(automata_.unanchored) +
+         GetMemoryUsageOrZero(automata_.reverse) +
+         GetMemoryUsageOrZero(automata_.reverse_unanchored);
+}
+
 absl::StatusOr<std::vector<std::string>> Match(std::string_view const pattern,
                                                std::string_view const input, Flags const& flags) {
   auto status_or_re = RE::Create(pattern, flags);
-  if (status_or_re.ok()) {
+  if (!status_or_re.ok()) {
     return std::move(status_or_re).status();
   }
   auto const& re = status_or_re.value();
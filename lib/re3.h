@@ -1,42 +1,95 @@
 #ifndef __RE3_LIB_RE3_H__
 #define __RE3_LIB_RE3_H__
 
+#include <cstddef>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <utility>
 #include <vector>
 
+#include "absl/functional/function_ref.h"
 #include "absl/status/statusor.h"
 #include "lib/automaton.h"
+#include "lib/flags.h"
+#include "lib/parser.h"
 
 namespace re3 {
 
-struct Flags {
-  bool full_match = false;
-  bool case_sensitive = true;
-};
-
+// A compiled regular expression.
+//
+// Unless `Flags::full_match` is set, `RE` looks for matches anywhere in the input. The end of the
+// earliest match is found by running an unanchored automaton (see `TempNFA::AllowAnyPrefix`) that
+// stops as soon as it accepts, its start is the leftmost one among the matches ending there, and
+// the match is then extended to the longest one starting there. Starts are found by running a
+// reversed automaton (see `TempNFA::Reverse`) backwards from the end of the match, so the whole
+// search takes linear time. A `Prefilter` skips to the first position where a match can start
+// before the unanchored automaton is run.
 class RE {
  public:
-  static absl::StatusOr<RE> Create(std::string_view pattern, Flags const& flags = {});
+  // Compiles `pattern`. The tables of the compiled automaton are allocated from `resource`, which
+  // must outlive the returned object and all of its copies, since copies allocate from the same
+  // resource. Temporary data used during compilation is allocated from an internal arena instead.
+  static absl::StatusOr<RE> Create(
+      std::string_view pattern, Flags const& flags = {},
+      std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 
-  RE(RE const& other) : automaton_(other.automaton_->Clone()) {}
+  RE(RE const& other) { *this = other; }
 
-  RE& operator=(RE const& other) {
-    automaton_ = other.automaton_->Clone();
-    return *this;
-  }
+  RE& operator=(RE const& other);
 
   RE(RE&&) noexcept = default;
   RE& operator=(RE&&) noexcept = default;
 
+  // Returns the earliest match in `input` as a view into it, or `std::nullopt` if there's none. In
+  // full-match mode the match is the whole `input`. Doesn't allocate memory in the steady state.
+  std::optional<std::string_view> Find(std::string_view input) const;
+
+  // Like `Find`, but looks for the match with the rightmost start, which is found by scanning
+  // `input` backwards from its end. The match is the longest one starting there. Equivalent to
+  // `Find` in full-match mode.
+  std::optional<std::string_view> FindLast(std::string_view input) const;
+
+  // Calls `callback` with every non-overlapping match in `input`, from left to right. Each match is
+  // found like `Find`, and the search resumes where it ends. Empty matches immediately following
+  // the previous match are skipped, so `a*` matches `baa` twice: before `b` and at `aa`. Doesn't
+  // allocate memory in the steady state.
+  void FindAll(std::string_view input, absl::FunctionRef<void(std::string_view)> callback) const;
+
+  // Checks whether `input` contains a match, stopping as soon as one is found. In full-match mode,
+  // checks whether the whole `input` matches.
+  bool IsMatch(std::string_view input) const;
+
+  // Returns the number of matches `FindAll` would find in `input`. When no match of the pattern is
+  // a proper prefix of another one (e.g. literals) only the ends of the matches are looked for,
+  // skipping the backward scans that find their starts.
+  size_t Count(std::string_view input) const;
+
+  // Splits `input` around the matches found by `FindAll`. There's always one more piece than there
+  // are matches, so pieces may be empty (e.g. if `input` begins with a match).
+  std::vector<std::string_view> Split(std::string_view input) const;
+
+  // Like `Find`, but copies the result. The result is empty if there's no match, otherwise its only
+  // element is the matched text.
   absl::StatusOr<std::vector<std::string>> Match(std::string_view input) const;
 
+  // Like `FindLast`, but copies the result like `Match`.
+  absl::StatusOr<std::vector<std::string>> MatchLast(std::string_view input) const;
+
+  // Returns the number of bytes held by the compiled automata, including their caches.
+  size_t GetMemoryUsage() const;
+
  private:
-  explicit RE(std::unique_ptr<AutomatonInterface> automaton) : automaton_(std::move(automaton)) {}
+  explicit RE(Automata automata) : automata_(std::move(automata)) {}
+
+  // Returns the end of the earliest match in `input` that starts at or after `position`, skipping
+  // ahead with the prefilter before running the unanchored automaton. REQUIRES: not in full-match
+  // mode.
+  std::optional<size_t> FindEarliestEnd(std::string_view input, size_t position) const;
 
-  std::unique_ptr<AutomatonInterface> automaton_;
+  Automata automata_;
 };
 
 absl::StatusOr<std::vector<std::string>> Match(std::string_view pattern, std::string_view input,
@@ -1,21 +1,77 @@
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
 #include "absl/status/status.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "lib/ast.h"
+#include "lib/automaton.h"
+#include "lib/counting_nfa.h"
+#include "lib/counting_set.h"
+#include "lib/dfa.h"
+#include "lib/flags.h"
+#include "lib/lazy_dfa.h"
+#include "lib/nfa.h"
 #include "lib/parser.h"
+#include "lib/prefilter.h"
+#include "lib/re3.h"
+#include "lib/shift_and.h"
+#include "lib/simplify.h"
+#include "lib/sparse_set.h"
 #include "lib/temp.h"
 #include "lib/testing.h"
 
 namespace {
 
+using ::re3::AST;
+using ::re3::Automata;
+using ::re3::ASTNode;
+using ::re3::CountingNFA;
+using ::re3::CountingSet;
+using ::re3::DFA;
+using ::re3::Flags;
+using ::re3::LazyDFA;
+using ::re3::NFA;
 using ::re3::Parse;
+using ::re3::Prefilter;
+using ::re3::PrefixLength;
+using ::re3::RE;
+using ::re3::ShiftAnd;
+using ::re3::SimplifyAST;
+using ::re3::SparseSet;
 using ::re3::TempNFA;
+using ::testing::Combine;
+using ::testing::ElementsAre;
+using ::testing::Field;
+using ::testing::IsEmpty;
+using ::testing::TestWithParam;
 using ::testing::Values;
+using ::testing::status::IsOkAndHolds;
 using ::testing::status::StatusIs;
 
-class ParserTest : public ::testing::TestWithParam<bool> {
+using Construction = Flags::Construction;
+using Engine = TempNFA::Engine;
+
+class ParserTest : public TestWithParam<std::tuple<std::optional<Engine>, Construction>> {
  protected:
-  explicit ParserTest() { TempNFA::force_nfa_for_testing = GetParam(); }
-  ~ParserTest() { TempNFA::force_nfa_for_testing = false; }
+  explicit ParserTest() {
+    TempNFA::force_engine_for_testing = std::get<0>(GetParam());
+    re3::force_construction_for_testing = std::get<1>(GetParam());
+  }
+
+  ~ParserTest() {
+    TempNFA::force_engine_for_testing = std::nullopt;
+    re3::force_construction_for_testing = std::nullopt;
+  }
 };
 
 TEST_P(ParserTest, Empty) {
@@ -403,6 +459,46 @@ TEST_P(ParserTest, HexCode3) {
   EXPECT_FALSE(pattern->Run("\\xaf"));
 }
 
+TEST_P(ParserTest, HighBytes) {
+  auto const status_or_pattern = Parse("caf\xC3\xA9+");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run("caf\xC3\xA9"));
+  EXPECT_TRUE(pattern->Run("caf\xC3\xA9\xA9"));
+  EXPECT_FALSE(pattern->Run("caf\xC3"));
+  EXPECT_FALSE(pattern->Run("caf\xC3\xA8"));
+  EXPECT_FALSE(pattern->Run("cafe"));
+}
+
+TEST_P(ParserTest, ZeroByte) {
+  auto const status_or_pattern = Parse("a\\x00b");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_FALSE(pattern->Run(""));
+  EXPECT_FALSE(pattern->Run("ab"));
+  EXPECT_TRUE(pattern->Run(std::string_view("a\0b", 3)));
+  EXPECT_FALSE(pattern->Run(std::string_view("a\0\0b", 4)));
+  EXPECT_FALSE(pattern->Run("a\\x00b"));
+}
+
+TEST_P(ParserTest, ZeroByteInClass) {
+  auto const status_or_pattern = Parse("[\\x00-\\x02]+");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_FALSE(pattern->Run(""));
+  EXPECT_TRUE(pattern->Run(std::string_view("\0", 1)));
+  EXPECT_TRUE(pattern->Run(std::string_view("\x01\0\x02\0", 4)));
+  EXPECT_FALSE(pattern->Run(std::string_view("\0\x03", 2)));
+}
+
+TEST_P(ParserTest, WildcardMatchesZeroByte) {
+  auto const status_or_pattern = Parse("a.[^b]");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run(std::string_view("a\0\0", 3)));
+  EXPECT_FALSE(pattern->Run(std::string_view("a\0b", 3)));
+}
+
 TEST_P(ParserTest, AnyCharacter) {
   auto const status_or_pattern = Parse(".");
   EXPECT_OK(status_or_pattern);
@@ -596,6 +692,62 @@ TEST_P(ParserTest, InvalidEscapeCodesInCharacterClass) {
   EXPECT_THAT(Parse("[\\a]"), StatusIs(absl::StatusCode::kInvalidArgument));
 }
 
+TEST_P(ParserTest, CharacterRange) {
+  auto const status_or_pattern = Parse("[a-fx\\x30-\\x39]");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_FALSE(pattern->Run(""));
+  EXPECT_TRUE(pattern->Run("a"));
+  EXPECT_TRUE(pattern->Run("c"));
+  EXPECT_TRUE(pattern->Run("f"));
+  EXPECT_FALSE(pattern->Run("g"));
+  EXPECT_TRUE(pattern->Run("x"));
+  EXPECT_FALSE(pattern->Run("-"));
+  EXPECT_TRUE(pattern->Run("0"));
+  EXPECT_TRUE(pattern->Run("9"));
+  EXPECT_FALSE(pattern->Run("ab"));
+}
+
+TEST_P(ParserTest, NegatedCharacterRange) {
+  auto const status_or_pattern = Parse("[^a-z0-9]+");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_FALSE(pattern->Run(""));
+  EXPECT_FALSE(pattern->Run("a"));
+  EXPECT_FALSE(pattern->Run("z"));
+  EXPECT_FALSE(pattern->Run("5"));
+  EXPECT_TRUE(pattern->Run("A"));
+  EXPECT_TRUE(pattern->Run("-_ "));
+  EXPECT_FALSE(pattern->Run("AbC"));
+}
+
+TEST_P(ParserTest, DashInCharacterClass) {
+  auto const status_or_pattern = Parse("[a-][-b][c\\-e]");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run("abc"));
+  EXPECT_TRUE(pattern->Run("--e"));
+  EXPECT_TRUE(pattern->Run("a--"));
+  EXPECT_FALSE(pattern->Run("abd"));
+}
+
+TEST_P(ParserTest, ShorthandsInCharacterClass) {
+  auto const status_or_pattern = Parse("[\\d.]+[^\\s\\d]");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run("3.14x"));
+  EXPECT_TRUE(pattern->Run("..-"));
+  EXPECT_FALSE(pattern->Run("3.14"));
+  EXPECT_FALSE(pattern->Run("3.14\t"));
+  EXPECT_FALSE(pattern->Run("3x4y"));
+}
+
+TEST_P(ParserTest, InvalidCharacterRange) {
+  EXPECT_THAT(Parse("[z-a]"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("[a-\\d]"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("[a-"), StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
 TEST_P(ParserTest, BlockBackrefsInCharacterClass) {
   EXPECT_THAT(Parse("[\\0]"), StatusIs(absl::StatusCode::kInvalidArgument));
   EXPECT_THAT(Parse("[\\1]"), StatusIs(absl::StatusCode::kInvalidArgument));
@@ -1015,11 +1167,24 @@ TEST_P(ParserTest, InvalidQuantifiers) {
   EXPECT_THAT(Parse("a{2 ,3}"), StatusIs(absl::StatusCode::kInvalidArgument));
   EXPECT_THAT(Parse("a{2, 3}"), StatusIs(absl::StatusCode::kInvalidArgument));
   EXPECT_THAT(Parse("a{2,3 }"), StatusIs(absl::StatusCode::kInvalidArgument));
-  EXPECT_THAT(Parse("a{1001}"), StatusIs(absl::StatusCode::kInvalidArgument));
-  EXPECT_THAT(Parse("a{1002}"), StatusIs(absl::StatusCode::kInvalidArgument));
-  EXPECT_THAT(Parse("a{1001,}"), StatusIs(absl::StatusCode::kInvalidArgument));
-  EXPECT_THAT(Parse("a{10,1001}"), StatusIs(absl::StatusCode::kInvalidArgument));
-  EXPECT_THAT(Parse("a{10,1002}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("a{100001}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("a{100002}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("a{100001,}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("a{10,100001}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("a{10,100002}"), StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_P(ParserTest, UnrolledRepetitionLimits) {
+  EXPECT_OK(Parse("(ab){1000}"));
+  EXPECT_THAT(Parse("(ab){1001}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("(ab){1001,}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("(ab){10,1001}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("((ab){300}){300}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse("((ab){100}(cd){100}){100}"), StatusIs(absl::StatusCode::kInvalidArgument));
+  // These are represented by counters.
+  EXPECT_OK(Parse("a{100000}"));
+  EXPECT_OK(Parse("(a|b){100000}"));
+  EXPECT_OK(Parse("(x[0-9]{5000}){1000}"));
 }
 
 TEST_P(ParserTest, MultipleQuantifiersDisallowed) {
@@ -1149,6 +1314,21 @@ TEST_P(ParserTest, Brackets) {
   EXPECT_FALSE(pattern->Run("banana"));
 }
 
+TEST_P(ParserTest, DeeplyNestedBrackets) {
+  auto const status_or_pattern = Parse(std::string(1000, '(') + "a" + std::string(1000, ')') + "b");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run("ab"));
+  EXPECT_FALSE(pattern->Run("a"));
+  EXPECT_FALSE(pattern->Run("abb"));
+}
+
+TEST_P(ParserTest, BracketsNestedTooDeeply) {
+  EXPECT_THAT(Parse(std::string(1001, '(') + "a" + std::string(1001, ')')),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Parse(std::string(100000, '(')), StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
 TEST_P(ParserTest, IpsumInBrackets) {
   auto const status_or_pattern = Parse("lorem(ipsum)dolor");
   EXPECT_OK(status_or_pattern);
@@ -1944,6 +2124,1119 @@ TEST_P(ParserTest, HeavyBacktracker) {
   EXPECT_FALSE(pattern->Run("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"));
 }
 
-INSTANTIATE_TEST_SUITE_P(ParserTest, ParserTest, Values(false, true));
+TEST_P(ParserTest, MaybeLoopingPiece) {
+  auto const status_or_pattern = Parse("(b+a+)?c");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run("c"));
+  EXPECT_TRUE(pattern->Run("bac"));
+  EXPECT_TRUE(pattern->Run("bbaac"));
+  EXPECT_FALSE(pattern->Run("ac"));
+  EXPECT_FALSE(pattern->Run("bc"));
+  EXPECT_FALSE(pattern->Run("babac"));
+}
+
+TEST_P(ParserTest, StarLoopingPiece) {
+  auto const status_or_pattern = Parse("(a+b)*");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run(""));
+  EXPECT_TRUE(pattern->Run("ab"));
+  EXPECT_TRUE(pattern->Run("aabab"));
+  EXPECT_FALSE(pattern->Run("a"));
+  EXPECT_FALSE(pattern->Run("aba"));
+  EXPECT_FALSE(pattern->Run("b"));
+}
+
+TEST_P(ParserTest, BoundedRepetitionOfLoopingPiece) {
+  auto const status_or_pattern = Parse("(a+b){1,2}");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_FALSE(pattern->Run(""));
+  EXPECT_TRUE(pattern->Run("ab"));
+  EXPECT_TRUE(pattern->Run("aabab"));
+  EXPECT_FALSE(pattern->Run("aba"));
+  EXPECT_FALSE(pattern->Run("ababa"));
+  EXPECT_FALSE(pattern->Run("ababab"));
+}
+
+TEST_P(ParserTest, ShortestPrefix) {
+  auto const status_or_pattern = Parse("a+b?");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_EQ(pattern->MatchPrefix("", PrefixLength::kShortest), std::nullopt);
+  EXPECT_EQ(pattern->MatchPrefix("b", PrefixLength::kShortest), std::nullopt);
+  EXPECT_EQ(pattern->MatchPrefix("a", PrefixLength::kShortest), 1);
+  EXPECT_EQ(pattern->MatchPrefix("aaab", PrefixLength::kShortest), 1);
+}
+
+TEST_P(ParserTest, LongestPrefix) {
+  auto const status_or_pattern = Parse("a+b?");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_EQ(pattern->MatchPrefix("", PrefixLength::kLongest), std::nullopt);
+  EXPECT_EQ(pattern->MatchPrefix("b", PrefixLength::kLongest), std::nullopt);
+  EXPECT_EQ(pattern->MatchPrefix("a", PrefixLength::kLongest), 1);
+  EXPECT_EQ(pattern->MatchPrefix("aaab", PrefixLength::kLongest), 4);
+  EXPECT_EQ(pattern->MatchPrefix("aaabb", PrefixLength::kLongest), 4);
+  EXPECT_EQ(pattern->MatchPrefix("aaaca", PrefixLength::kLongest), 3);
+}
+
+TEST_P(ParserTest, EmptyPrefix) {
+  auto const status_or_pattern = Parse("a*");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_EQ(pattern->MatchPrefix("", PrefixLength::kShortest), 0);
+  EXPECT_EQ(pattern->MatchPrefix("aab", PrefixLength::kShortest), 0);
+  EXPECT_EQ(pattern->MatchPrefix("", PrefixLength::kLongest), 0);
+  EXPECT_EQ(pattern->MatchPrefix("aab", PrefixLength::kLongest), 2);
+}
+
+TEST_P(ParserTest, PrefixAfterMatchState) {
+  auto const status_or_pattern = Parse("lorem.*");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_EQ(pattern->MatchPrefix("lorem ipsum", PrefixLength::kShortest), 5);
+  EXPECT_EQ(pattern->MatchPrefix("lorem ipsum", PrefixLength::kLongest), 11);
+  EXPECT_EQ(pattern->MatchPrefix("lore", PrefixLength::kLongest), std::nullopt);
+}
+
+TEST_P(ParserTest, PrefixWithCounter) {
+  auto const status_or_pattern = Parse("a.{2,200}b");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_EQ(pattern->MatchPrefix("axxbxb", PrefixLength::kShortest), 4);
+  EXPECT_EQ(pattern->MatchPrefix("axxbxb", PrefixLength::kLongest), 6);
+  EXPECT_EQ(pattern->MatchPrefix("axbc", PrefixLength::kLongest), std::nullopt);
+}
+
+TEST_P(ParserTest, Suffix) {
+  auto const status_or_pattern = Parse("ba+");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_EQ(pattern->MatchSuffix("", PrefixLength::kShortest), std::nullopt);
+  EXPECT_EQ(pattern->MatchSuffix("xaab", PrefixLength::kShortest), 2);
+  EXPECT_EQ(pattern->MatchSuffix("xaab", PrefixLength::kLongest), 3);
+  EXPECT_EQ(pattern->MatchSuffix("xaabb", PrefixLength::kLongest), std::nullopt);
+  EXPECT_EQ(pattern->MatchSuffix("xaa", PrefixLength::kLongest), std::nullopt);
+}
+
+INSTANTIATE_TEST_SUITE_P(ParserTest, ParserTest,
+                         Combine(Values(std::nullopt, Engine::kNFA, Engine::kShiftAnd,
+                                        Engine::kLazyDFA),
+                                 Values(Construction::kThompson, Construction::kGlushkov)));
+
+class RETest : public TestWithParam<std::tuple<std::optional<Engine>, Construction>> {
+ protected:
+  explicit RETest() {
+    TempNFA::force_engine_for_testing = std::get<0>(GetParam());
+    re3::force_construction_for_testing = std::get<1>(GetParam());
+  }
+
+  ~RETest() {
+    TempNFA::force_engine_for_testing = std::nullopt;
+    re3::force_construction_for_testing = std::nullopt;
+  }
+};
+
+TEST_P(RETest, FullMatch) {
+  Flags flags;
+  flags.full_match = true;
+  auto const status_or_re = RE::Create("a+b", flags);
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.Match("aab"), IsOkAndHolds(ElementsAre("aab")));
+  EXPECT_THAT(re.Match("xaab"), IsOkAndHolds(IsEmpty()));
+  EXPECT_THAT(re.Match("aabx"), IsOkAndHolds(IsEmpty()));
+}
+
+TEST_P(RETest, Search) {
+  auto const status_or_re = RE::Create("a+b");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.Match("aab"), IsOkAndHolds(ElementsAre("aab")));
+  EXPECT_THAT(re.Match("xxaabyy"), IsOkAndHolds(ElementsAre("aab")));
+  EXPECT_THAT(re.Match("ab aab"), IsOkAndHolds(ElementsAre("ab")));
+  EXPECT_THAT(re.Match("aa bb"), IsOkAndHolds(IsEmpty()));
+  EXPECT_THAT(re.Match(""), IsOkAndHolds(IsEmpty()));
+}
+
+TEST_P(RETest, SearchExtendsMatch) {
+  auto const status_or_re = RE::Create("b+");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.Match("aabbbcbb"), IsOkAndHolds(ElementsAre("bbb")));
+}
+
+TEST_P(RETest, SearchEmptyMatch) {
+  auto const status_or_re = RE::Create("a*");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.Match("baa"), IsOkAndHolds(ElementsAre("")));
+  EXPECT_THAT(re.Match("aab"), IsOkAndHolds(ElementsAre("aa")));
+}
+
+TEST_P(RETest, SearchNonDeterministic) {
+  auto const status_or_re = RE::Create("(a|b)*a(a|b)(a|b)");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.Match("xxbaabyy"), IsOkAndHolds(ElementsAre("baab")));
+  EXPECT_THAT(re.Match("xxbbbyy"), IsOkAndHolds(IsEmpty()));
+}
+
+TEST_P(RETest, SearchWithCounter) {
+  auto const status_or_re = RE::Create("a.{2,200}b");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.Match("xxaxxbyy"), IsOkAndHolds(ElementsAre("axxb")));
+}
+
+TEST_P(RETest, ReverseAutomaton) {
+  auto const status_or_automata = re3::Compile("ab+c");
+  EXPECT_OK(status_or_automata);
+  auto const& automata = status_or_automata.value();
+  EXPECT_EQ(automata.reverse->MatchSuffix("xabbc", PrefixLength::kLongest), 4);
+  EXPECT_EQ(automata.reverse->MatchSuffix("xabbcx", PrefixLength::kLongest), std::nullopt);
+  EXPECT_EQ(automata.reverse->MatchSuffix("xbbc", PrefixLength::kLongest), std::nullopt);
+  EXPECT_EQ(automata.reverse_unanchored->MatchSuffix("abcabbcx", PrefixLength::kShortest), 5);
+  EXPECT_EQ(automata.reverse_unanchored->MatchSuffix("abcx", PrefixLength::kShortest), 4);
+  EXPECT_EQ(automata.reverse_unanchored->MatchSuffix("xbcx", PrefixLength::kShortest),
+            std::nullopt);
+}
+
+TEST_P(RETest, ReverseAutomatonWithCounter) {
+  Flags flags;
+  flags.max_unrolled_class_repetitions = 1;
+  auto const status_or_automata = re3::Compile("ab{2,3}c", flags);
+  EXPECT_OK(status_or_automata);
+  auto const& automata = status_or_automata.value();
+  EXPECT_EQ(automata.reverse->MatchSuffix("xabbc", PrefixLength::kLongest), 4);
+  EXPECT_EQ(automata.reverse->MatchSuffix("xabbbc", PrefixLength::kLongest), 5);
+  EXPECT_EQ(automata.reverse->MatchSuffix("xabc", PrefixLength::kLongest), std::nullopt);
+  EXPECT_EQ(automata.reverse->MatchSuffix("xabbbbc", PrefixLength::kLongest), std::nullopt);
+}
+
+TEST_P(RETest, MatchLast) {
+  auto const status_or_re = RE::Create("a+b");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.MatchLast("aab xaaab"), IsOkAndHolds(ElementsAre("ab")));
+  EXPECT_THAT(re.MatchLast("aab ab yy"), IsOkAndHolds(ElementsAre("ab")));
+  EXPECT_THAT(re.MatchLast("ab"), IsOkAndHolds(ElementsAre("ab")));
+  EXPECT_THAT(re.MatchLast("aa bb"), IsOkAndHolds(IsEmpty()));
+  EXPECT_THAT(re.MatchLast(""), IsOkAndHolds(IsEmpty()));
+}
+
+TEST_P(RETest, MatchLastExtendsMatch) {
+  auto const status_or_re = RE::Create("a.{2,200}b");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.MatchLast("axxbxaxxbyy"), IsOkAndHolds(ElementsAre("axxb")));
+  EXPECT_THAT(re.MatchLast("axxbxaxxbb"), IsOkAndHolds(ElementsAre("axxbb")));
+}
+
+TEST_P(RETest, MatchLastFullMatch) {
+  Flags flags;
+  flags.full_match = true;
+  auto const status_or_re = RE::Create("a+b", flags);
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.MatchLast("aab"), IsOkAndHolds(ElementsAre("aab")));
+  EXPECT_THAT(re.MatchLast("aabx"), IsOkAndHolds(IsEmpty()));
+}
+
+TEST_P(RETest, Find) {
+  auto const status_or_re = RE::Create("a+b");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  std::string_view const input = "xxaabyy";
+  auto const match = re.Find(input);
+  ASSERT_TRUE(match.has_value());
+  EXPECT_EQ(match->data(), input.data() + 2);
+  EXPECT_EQ(match->size(), 3);
+  EXPECT_EQ(re.Find("aa bb"), std::nullopt);
+}
+
+TEST_P(RETest, FindLast) {
+  auto const status_or_re = RE::Create("a+b");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  std::string_view const input = "aab xaaab";
+  auto const match = re.FindLast(input);
+  ASSERT_TRUE(match.has_value());
+  EXPECT_EQ(match->data(), input.data() + 7);
+  EXPECT_EQ(*match, "ab");
+  EXPECT_EQ(re.FindLast("aa bb"), std::nullopt);
+}
+
+TEST_P(RETest, FindAll) {
+  auto const status_or_re = RE::Create("a+b");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  std::vector<std::string_view> matches;
+  re.FindAll("aab xabab aa b", [&](std::string_view const match) { matches.push_back(match); });
+  EXPECT_THAT(matches, ElementsAre("aab", "ab", "ab"));
+  matches.clear();
+  re.FindAll("xyz", [&](std::string_view const match) { matches.push_back(match); });
+  EXPECT_THAT(matches, IsEmpty());
+}
+
+TEST_P(RETest, FindAllEmptyMatches) {
+  auto const status_or_re = RE::Create("a*");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  std::vector<std::string_view> matches;
+  re.FindAll("baacb", [&](std::string_view const match) { matches.push_back(match); });
+  EXPECT_THAT(matches, ElementsAre("", "aa", "", ""));
+  matches.clear();
+  re.FindAll("", [&](std::string_view const match) { matches.push_back(match); });
+  EXPECT_THAT(matches, ElementsAre(""));
+}
+
+TEST_P(RETest, FindAllFullMatch) {
+  Flags flags;
+  flags.full_match = true;
+  auto const status_or_re = RE::Create("a+b", flags);
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  std::vector<std::string_view> matches;
+  re.FindAll("aab", [&](std::string_view const match) { matches.push_back(match); });
+  EXPECT_THAT(matches, ElementsAre("aab"));
+  matches.clear();
+  re.FindAll("aab ab", [&](std::string_view const match) { matches.push_back(match); });
+  EXPECT_THAT(matches, IsEmpty());
+}
+
+TEST_P(RETest, IsMatch) {
+  auto const status_or_re = RE::Create("a+b");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_TRUE(re.IsMatch("xxaabyy"));
+  EXPECT_TRUE(re.IsMatch("ab"));
+  EXPECT_FALSE(re.IsMatch("aa bb"));
+  EXPECT_FALSE(re.IsMatch(""));
+}
+
+TEST_P(RETest, IsMatchFullMatch) {
+  Flags flags;
+  flags.full_match = true;
+  auto const status_or_re = RE::Create("a+b", flags);
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_TRUE(re.IsMatch("aab"));
+  EXPECT_FALSE(re.IsMatch("xaab"));
+}
+
+TEST_P(RETest, PrefixFree) {
+  EXPECT_THAT(re3::Compile("lorem|ipsum"), IsOkAndHolds(Field(&Automata::prefix_free, true)));
+  EXPECT_THAT(re3::Compile("a[0-9]{20}"), IsOkAndHolds(Field(&Automata::prefix_free, true)));
+  EXPECT_THAT(re3::Compile(""), IsOkAndHolds(Field(&Automata::prefix_free, true)));
+  EXPECT_THAT(re3::Compile("lorem|lore"), IsOkAndHolds(Field(&Automata::prefix_free, false)));
+  EXPECT_THAT(re3::Compile("a+"), IsOkAndHolds(Field(&Automata::prefix_free, false)));
+  EXPECT_THAT(re3::Compile("a*b"), IsOkAndHolds(Field(&Automata::prefix_free, true)));
+  EXPECT_THAT(re3::Compile("a.{2,200}b"), IsOkAndHolds(Field(&Automata::prefix_free, false)));
+  // Unrolled into a DFA.
+  EXPECT_THAT(re3::Compile("a.{200}b"), IsOkAndHolds(Field(&Automata::prefix_free, true)));
+  // Automata with counters aren't analyzed.
+  EXPECT_THAT(re3::Compile("(a|b)*a[ab]{200}"),
+              IsOkAndHolds(Field(&Automata::prefix_free, false)));
+  // Full matches don't use it.
+  Flags flags;
+  flags.full_match = true;
+  EXPECT_THAT(re3::Compile("lorem|ipsum", flags),
+              IsOkAndHolds(Field(&Automata::prefix_free, false)));
+}
+
+TEST_P(RETest, Count) {
+  auto const status_or_re = RE::Create("ab|cd");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_EQ(re.Count("abcd xab ac"), 3);
+  EXPECT_EQ(re.Count("abab"), 2);
+  EXPECT_EQ(re.Count("xyz"), 0);
+  EXPECT_EQ(re.Count(""), 0);
+}
+
+TEST_P(RETest, CountExtendedMatches) {
+  auto const status_or_re = RE::Create("a+b?");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_EQ(re.Count("aaab aa xa"), 3);
+}
+
+TEST_P(RETest, CountEmptyMatches) {
+  auto const status_or_re = RE::Create("");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_EQ(re.Count("abc"), 4);
+}
+
+TEST_P(RETest, CountFullMatch) {
+  Flags flags;
+  flags.full_match = true;
+  auto const status_or_re = RE::Create("a+b", flags);
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_EQ(re.Count("aab"), 1);
+  EXPECT_EQ(re.Count("ab ab"), 0);
+}
+
+TEST_P(RETest, Split) {
+  auto const status_or_re = RE::Create(", *");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.Split("lorem, ipsum,dolor,  amet"),
+              ElementsAre("lorem", "ipsum", "dolor", "amet"));
+  EXPECT_THAT(re.Split(",lorem,"), ElementsAre("", "lorem", ""));
+  EXPECT_THAT(re.Split("lorem"), ElementsAre("lorem"));
+  EXPECT_THAT(re.Split(""), ElementsAre(""));
+}
+
+TEST_P(RETest, PrefilteredSearch) {
+  auto const status_or_re = RE::Create("ERROR: \\d+");
+  EXPECT_OK(status_or_re);
+  auto const& re = status_or_re.value();
+  EXPECT_THAT(re.Match("lorem ERROR: x ERRERROR: 42 ipsum"),
+              IsOkAndHolds(ElementsAre("ERROR: 42")));
+  EXPECT_THAT(re.Match("lorem ERROR: x ipsum"), IsOkAndHolds(IsEmpty()));
+  EXPECT_TRUE(re.IsMatch("ERROR: 1"));
+  EXPECT_FALSE(re.IsMatch("ERROR: "));
+  EXPECT_EQ(re.Count("ERROR: 1 ERROR: x ERROR: 23"), 2);
+}
+
+TEST_P(RETest, PrefilteredUnanchoredAutomaton) {
+  auto const status_or_automata = re3::Compile("ERROR: \\d+");
+  EXPECT_OK(status_or_automata);
+  auto const& automata = status_or_automata.value();
+  EXPECT_EQ(automata.prefilter.literal(), "ERROR: ");
+  EXPECT_EQ(automata.unanchored->MatchPrefix("EE ERROR: x ERROR: 1", PrefixLength::kShortest), 20);
+  EXPECT_EQ(automata.unanchored->MatchPrefix("EE ERROR: x ERROR: ", PrefixLength::kShortest),
+            std::nullopt);
+}
+
+TEST_P(RETest, Copy) {
+  auto const status_or_re = RE::Create("a+b");
+  EXPECT_OK(status_or_re);
+  RE const copy = status_or_re.value();
+  EXPECT_THAT(copy.Match("xaab"), IsOkAndHolds(ElementsAre("aab")));
+}
+
+TEST_P(RETest, MatchFunction) {
+  EXPECT_THAT(re3::Match("a+b", "xaabx"), IsOkAndHolds(ElementsAre("aab")));
+  EXPECT_THAT(re3::Match("a(b", "xaabx"), StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+INSTANTIATE_TEST_SUITE_P(RETest, RETest,
+                         Combine(Values(std::nullopt, Engine::kNFA, Engine::kShiftAnd,
+                                        Engine::kLazyDFA),
+                                 Values(Construction::kThompson, Construction::kGlushkov)));
+
+TEST(FinalizeTest, DeterminizeNonDeterministicAutomaton) {
+  auto const status_or_pattern = Parse("a*ab|(ab|ac)");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<DFA<uint8_t> const*>(pattern.get()), nullptr);
+  EXPECT_FALSE(pattern->Run(""));
+  EXPECT_TRUE(pattern->Run("ab"));
+  EXPECT_TRUE(pattern->Run("aab"));
+  EXPECT_TRUE(pattern->Run("aaab"));
+  EXPECT_TRUE(pattern->Run("ac"));
+  EXPECT_FALSE(pattern->Run("aac"));
+  EXPECT_FALSE(pattern->Run("aba"));
+}
+
+TEST(FinalizeTest, MinimizeDFA) {
+  auto const status_or_pattern = Parse("(a|b)*abb");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  auto const dfa = dynamic_cast<DFA<uint8_t> const*>(pattern.get());
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_EQ(dfa->num_states(), 4);
+  EXPECT_FALSE(pattern->Run(""));
+  EXPECT_FALSE(pattern->Run("ab"));
+  EXPECT_TRUE(pattern->Run("abb"));
+  EXPECT_TRUE(pattern->Run("babb"));
+  EXPECT_TRUE(pattern->Run("abababb"));
+  EXPECT_FALSE(pattern->Run("abba"));
+  EXPECT_FALSE(pattern->Run("abbc"));
+}
+
+TEST(FinalizeTest, MinimizeDeterministicAutomaton) {
+  auto const status_or_pattern = Parse("lorem|ipsum|dolorem");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  auto const dfa = dynamic_cast<DFA<uint8_t> const*>(pattern.get());
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_EQ(dfa->num_states(), 11);
+  EXPECT_TRUE(pattern->Run("lorem"));
+  EXPECT_TRUE(pattern->Run("ipsum"));
+  EXPECT_TRUE(pattern->Run("dolorem"));
+  EXPECT_FALSE(pattern->Run("dolor"));
+  EXPECT_FALSE(pattern->Run("loremipsum"));
+}
+
+TEST(FinalizeTest, MinimizationDisabled) {
+  Flags flags;
+  flags.max_minimized_dfa_states = 0;
+  auto const status_or_pattern = Parse("(ab)*|a(ba)*b", flags);
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  auto const dfa = dynamic_cast<DFA<uint8_t> const*>(pattern.get());
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_GT(dfa->num_states(), 2);
+  EXPECT_TRUE(pattern->Run(""));
+  EXPECT_TRUE(pattern->Run("abab"));
+  EXPECT_FALSE(pattern->Run("aba"));
+}
+
+TEST(FinalizeTest, MatchState) {
+  auto const status_or_pattern = Parse("lorem.*");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<DFA<uint8_t> const*>(pattern.get()), nullptr);
+  EXPECT_FALSE(pattern->Run("lore"));
+  EXPECT_TRUE(pattern->Run("lorem"));
+  EXPECT_TRUE(pattern->Run("lorem ipsum dolor sit amet"));
+  EXPECT_FALSE(pattern->Run("loram ipsum dolor sit amet"));
+  EXPECT_TRUE(pattern->Run(std::string_view("lorem ipsum\0dolor sit amet", 26)));
+  EXPECT_TRUE(pattern->Run(std::string_view("lorem\0", 6)));
+}
+
+TEST(FinalizeTest, DFAPrefix) {
+  auto const status_or_pattern = Parse("xa(bcd)*");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<DFA<uint8_t> const*>(pattern.get()), nullptr);
+  EXPECT_EQ(pattern->MatchPrefix("xabcdbcdbcdbc", PrefixLength::kShortest), 2);
+  EXPECT_EQ(pattern->MatchPrefix("xabcdbcdbcdbc", PrefixLength::kLongest), 11);
+  EXPECT_EQ(pattern->MatchPrefix("xabcdbcdbcdbcd", PrefixLength::kLongest), 14);
+  EXPECT_EQ(pattern->MatchPrefix("xbcdbcdbcdbcd", PrefixLength::kLongest), std::nullopt);
+}
+
+TEST(FinalizeTest, StateIdWidth) {
+  auto const status_or_pattern1 = Parse("(a|b)*a(a|b){7}");
+  EXPECT_OK(status_or_pattern1);
+  auto const& pattern1 = status_or_pattern1.value();
+  auto const dfa1 = dynamic_cast<DFA<uint16_t> const*>(pattern1.get());
+  ASSERT_NE(dfa1, nullptr);
+  EXPECT_EQ(dfa1->num_states(), 256);
+  EXPECT_TRUE(pattern1->Run("abbbbbbb"));
+  EXPECT_FALSE(pattern1->Run("abbbbbbbb"));
+  auto const status_or_pattern2 = Parse("(a|b)*a(a|b){14}");
+  EXPECT_OK(status_or_pattern2);
+  auto const& pattern2 = status_or_pattern2.value();
+  EXPECT_NE(dynamic_cast<DFA<uint32_t> const*>(pattern2.get()), nullptr);
+  EXPECT_TRUE(pattern2->Run("abbbbbbbbbbbbbb"));
+  EXPECT_FALSE(pattern2->Run("abbbbbbbbbbbbbbb"));
+}
+
+TEST(FinalizeTest, LongSequence) {
+  auto const status_or_pattern = Parse("(ab?){1000}");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run(std::string(1000, 'a')));
+  EXPECT_TRUE(pattern->Run(std::string(1000, 'a') + "b"));
+  EXPECT_FALSE(pattern->Run(std::string(999, 'a')));
+  EXPECT_FALSE(pattern->Run(std::string(1001, 'a')));
+}
+
+TEST(FinalizeTest, DFATooLarge) {
+  Flags flags;
+  flags.max_dfa_bytes = 16;
+  flags.max_shift_and_positions = 0;
+  auto const status_or_pattern = Parse("(a|b)*a(a|b)(a|b)(a|b)", flags);
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<LazyDFA const*>(pattern.get()), nullptr);
+  EXPECT_TRUE(pattern->Run("babbb"));
+  EXPECT_FALSE(pattern->Run("abbbb"));
+}
+
+TEST(FinalizeTest, DFATooLargeForShiftAnd) {
+  Flags flags;
+  flags.max_dfa_bytes = 16;
+  auto const status_or_pattern = Parse("(a|b)*a(a|b)(a|b)(a|b)", flags);
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<ShiftAnd<1> const*>(pattern.get()), nullptr);
+  EXPECT_TRUE(pattern->Run("babbb"));
+  EXPECT_FALSE(pattern->Run("abbbb"));
+}
+
+TEST(FinalizeTest, DeterminizationTooLong) {
+  Flags flags;
+  flags.max_determinization_bytes = 16;
+  flags.max_shift_and_positions = 0;
+  auto const status_or_pattern = Parse("(a|b)*a(a|b)(a|b)(a|b)", flags);
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<LazyDFA const*>(pattern.get()), nullptr);
+  EXPECT_TRUE(pattern->Run("babbb"));
+  EXPECT_FALSE(pattern->Run("abbbb"));
+}
+
+TEST(FinalizeTest, GlushkovConstruction) {
+  Flags flags;
+  flags.construction = Construction::kGlushkov;
+  auto const status_or_pattern = Parse("(a|b)*abb", flags);
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  auto const dfa = dynamic_cast<DFA<uint8_t> const*>(pattern.get());
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_EQ(dfa->num_states(), 4);
+  EXPECT_FALSE(pattern->Run("ab"));
+  EXPECT_TRUE(pattern->Run("abb"));
+  EXPECT_TRUE(pattern->Run("abababb"));
+  EXPECT_FALSE(pattern->Run("abba"));
+}
+
+class LazyDFATest : public TestWithParam<size_t> {
+ protected:
+  explicit LazyDFATest() { TempNFA::force_engine_for_testing = Engine::kLazyDFA; }
+  ~LazyDFATest() { TempNFA::force_engine_for_testing = std::nullopt; }
+
+  Flags flags() const {
+    Flags flags;
+    flags.lazy_dfa_cache_bytes = GetParam();
+    return flags;
+  }
+};
+
+TEST_P(LazyDFATest, ExponentialBlowUp) {
+  auto const status_or_pattern = Parse("(a|b)*a(a|b)(a|b)(a|b)", flags());
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_FALSE(pattern->Run(""));
+  EXPECT_FALSE(pattern->Run("abb"));
+  EXPECT_TRUE(pattern->Run("abbb"));
+  EXPECT_TRUE(pattern->Run("babbb"));
+  EXPECT_FALSE(pattern->Run("abbbb"));
+  EXPECT_TRUE(pattern->Run("bbabab"));
+  EXPECT_TRUE(pattern->Run("ababbabaaab"));
+  EXPECT_FALSE(pattern->Run("ababbabbaab"));
+  EXPECT_FALSE(pattern->Run("ababbabaaabc"));
+  EXPECT_TRUE(pattern->Run("abababababababababababababababaabbabbbbaaaaaaabababbbbaaaabab"));
+  EXPECT_FALSE(pattern->Run("abababababababababababababababaabbabbbbaaaaaaabababbbbaaabbbb"));
+}
+
+TEST_P(LazyDFATest, RepeatedRuns) {
+  auto const status_or_pattern = Parse("(lorem|ipsum|dolor|lorems)+", flags());
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_FALSE(pattern->Run(""));
+    EXPECT_TRUE(pattern->Run("lorem"));
+    EXPECT_TRUE(pattern->Run("loremsipsum"));
+    EXPECT_TRUE(pattern->Run("doloripsumloremsdolor"));
+    EXPECT_FALSE(pattern->Run("doloripsumloremsdolo"));
+    EXPECT_FALSE(pattern->Run("loremss"));
+  }
+}
+
+TEST_P(LazyDFATest, ConcurrentRuns) {
+  auto const status_or_pattern = Parse("(a|b)*a(a|b)(a|b)(a|b)", flags());
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&pattern] {
+      for (int j = 0; j < 100; ++j) {
+        EXPECT_TRUE(pattern->Run("abababababababababababababababaabbabbbbaaaaaaabababbbbaaaabab"));
+        EXPECT_FALSE(pattern->Run("abababababababababababababababaabbabbbbaaaaaaabababbbbaaabbbb"));
+        EXPECT_EQ(pattern->MatchPrefix("babbbab", PrefixLength::kShortest), 5);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(LazyDFATest, LazyDFATest, Values(1, 1000, 4000, 1 << 20));
+
+class NFATest : public ::testing::Test {
+ protected:
+  explicit NFATest() { TempNFA::force_engine_for_testing = Engine::kNFA; }
+  ~NFATest() { TempNFA::force_engine_for_testing = std::nullopt; }
+};
+
+TEST_F(NFATest, LongEpsilonChains) {
+  auto const status_or_pattern = Parse("((((a?)?b?)?c?)?d?)*e");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<NFA const*>(pattern.get()), nullptr);
+  EXPECT_TRUE(pattern->Run("e"));
+  EXPECT_TRUE(pattern->Run("abcde"));
+  EXPECT_TRUE(pattern->Run("dcbae"));
+  EXPECT_TRUE(pattern->Run("aaddbbcce"));
+  EXPECT_FALSE(pattern->Run("abcd"));
+  EXPECT_FALSE(pattern->Run("abcdef"));
+}
+
+TEST_F(NFATest, RangeEdges) {
+  auto const status_or_pattern = Parse("\\w");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  auto const nfa = dynamic_cast<NFA const*>(pattern.get());
+  ASSERT_NE(nfa, nullptr);
+  auto const edges = nfa->edges(nfa->initial_state());
+  ASSERT_EQ(edges.size(), 4);
+  EXPECT_EQ(edges[0].first, '0');
+  EXPECT_EQ(edges[0].last, '9');
+  EXPECT_EQ(edges[1].first, 'A');
+  EXPECT_EQ(edges[1].last, 'Z');
+  EXPECT_EQ(edges[2].first, '_');
+  EXPECT_EQ(edges[2].last, '_');
+  EXPECT_EQ(edges[3].first, 'a');
+  EXPECT_EQ(edges[3].last, 'z');
+  EXPECT_THAT(nfa->targets(edges[3]), ElementsAre(nfa->final_state()));
+  EXPECT_TRUE(pattern->Run("q"));
+  EXPECT_TRUE(pattern->Run("_"));
+  EXPECT_FALSE(pattern->Run("-"));
+}
+
+TEST_F(NFATest, OverlappingRanges) {
+  auto const status_or_pattern = Parse("(\\w|[abcdef])x|[^0123456789]y");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run("ax"));
+  EXPECT_TRUE(pattern->Run("ay"));
+  EXPECT_TRUE(pattern->Run("0x"));
+  EXPECT_FALSE(pattern->Run("0y"));
+  EXPECT_TRUE(pattern->Run("-y"));
+  EXPECT_FALSE(pattern->Run("-x"));
+}
+
+TEST_F(NFATest, RepeatedRuns) {
+  auto const status_or_pattern = Parse("(lorem|ipsum|dolor|lorems)+");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  auto const copy = pattern->Clone();
+  for (int i = 0; i < 3; ++i) {
+    for (auto const* automaton : {pattern.get(), copy.get()}) {
+      EXPECT_FALSE(automaton->Run(""));
+      EXPECT_TRUE(automaton->Run("lorem"));
+      EXPECT_TRUE(automaton->Run("loremsipsum"));
+      EXPECT_TRUE(automaton->Run("doloripsumloremsdolor"));
+      EXPECT_FALSE(automaton->Run("doloripsumloremsdolo"));
+      EXPECT_FALSE(automaton->Run("loremss"));
+    }
+  }
+}
+
+TEST_F(NFATest, ZeroByte) {
+  auto const status_or_pattern = Parse("a.*b");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_TRUE(pattern->Run("a b"));
+  EXPECT_TRUE(pattern->Run(std::string_view("a\0b", 3)));
+  EXPECT_FALSE(pattern->Run(std::string_view("a\0c", 3)));
+}
+
+class ShiftAndTest : public ::testing::Test {
+ protected:
+  explicit ShiftAndTest() { TempNFA::force_engine_for_testing = Engine::kShiftAnd; }
+  ~ShiftAndTest() { TempNFA::force_engine_for_testing = std::nullopt; }
+};
+
+TEST_F(ShiftAndTest, WordsAroundAt) {
+  auto const status_or_pattern = Parse("\\w+@\\w+");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  auto const shift_and = dynamic_cast<ShiftAnd<1> const*>(pattern.get());
+  ASSERT_NE(shift_and, nullptr);
+  EXPECT_EQ(shift_and->num_positions(), 4);
+  EXPECT_TRUE(pattern->Run("foo@bar"));
+  EXPECT_TRUE(pattern->Run("a@b"));
+  EXPECT_FALSE(pattern->Run("foo@"));
+  EXPECT_FALSE(pattern->Run("@bar"));
+  EXPECT_FALSE(pattern->Run("foo@bar@baz"));
+  EXPECT_FALSE(pattern->Run("foo bar@baz"));
+}
+
+TEST_F(ShiftAndTest, SharedPrefix) {
+  auto const status_or_pattern = Parse("(a|ab)c");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<ShiftAnd<1> const*>(pattern.get()), nullptr);
+  EXPECT_TRUE(pattern->Run("ac"));
+  EXPECT_TRUE(pattern->Run("abc"));
+  EXPECT_FALSE(pattern->Run("a"));
+  EXPECT_FALSE(pattern->Run("ab"));
+  EXPECT_FALSE(pattern->Run("bc"));
+  EXPECT_FALSE(pattern->Run("abbc"));
+}
+
+TEST_F(ShiftAndTest, TwoWords) {
+  auto const status_or_pattern =
+      Parse("(x|xy)*abcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghij");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<ShiftAnd<2> const*>(pattern.get()), nullptr);
+  std::string input = "xyxxy";
+  for (int i = 0; i < 7; ++i) {
+    input += "abcdefghij";
+  }
+  EXPECT_TRUE(pattern->Run(input));
+  EXPECT_TRUE(pattern->Run(input.substr(5)));
+  EXPECT_FALSE(pattern->Run(input.substr(0, input.size() - 1)));
+  EXPECT_FALSE(pattern->Run("y" + input));
+}
+
+TEST_F(ShiftAndTest, TooManyPositions) {
+  std::string regex = "(x|xy)*";
+  std::string input = "xy";
+  for (int i = 0; i < 14; ++i) {
+    regex += "abcdefghij";
+    input += "abcdefghij";
+  }
+  auto const status_or_pattern = Parse(regex);
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<LazyDFA const*>(pattern.get()), nullptr);
+  EXPECT_TRUE(pattern->Run(input));
+  EXPECT_FALSE(pattern->Run(input + "a"));
+}
+
+class CountingNFATest : public ::testing::Test {
+ protected:
+  // Flags under which no unrolled repetition fits in the `DFA`, so that the repetitions above
+  // `Flags::max_unrolled_class_repetitions` are always represented by counters.
+  static Flags flags() {
+    Flags flags;
+    flags.max_dfa_bytes = 0;
+    return flags;
+  }
+};
+
+TEST_F(CountingNFATest, LargeBoundedRepetition) {
+  auto const status_or_pattern = Parse("a.{0,1000}b", flags());
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  auto const counting_nfa = dynamic_cast<CountingNFA const*>(pattern.get());
+  ASSERT_NE(counting_nfa, nullptr);
+  EXPECT_EQ(counting_nfa->num_counters(), 1);
+  EXPECT_TRUE(pattern->Run("ab"));
+  EXPECT_TRUE(pattern->Run("a" + std::string(1000, 'b') + "b"));
+  EXPECT_FALSE(pattern->Run("a" + std::string(1001, 'b') + "b"));
+  EXPECT_TRUE(pattern->Run("a" + std::string(1000, 'a') + "b"));
+  EXPECT_FALSE(pattern->Run("a" + std::string(1000, 'a')));
+}
+
+TEST_F(CountingNFATest, LowerBound) {
+  auto const status_or_pattern = Parse("x[ab]{150,200}", flags());
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<CountingNFA const*>(pattern.get()), nullptr);
+  EXPECT_FALSE(pattern->Run("x" + std::string(149, 'a')));
+  EXPECT_TRUE(pattern->Run("x" + std::string(150, 'a')));
+  EXPECT_TRUE(pattern->Run("x" + std::string(100, 'a') + std::string(100, 'b')));
+  EXPECT_FALSE(pattern->Run("x" + std::string(201, 'b')));
+  EXPECT_FALSE(pattern->Run("x" + std::string(100, 'a') + "c" + std::string(99, 'b')));
+}
+
+TEST_F(CountingNFATest, Unbounded) {
+  auto const status_or_pattern = Parse("a{200,}", flags());
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<CountingNFA const*>(pattern.get()), nullptr);
+  EXPECT_FALSE(pattern->Run(std::string(199, 'a')));
+  EXPECT_TRUE(pattern->Run(std::string(200, 'a')));
+  EXPECT_TRUE(pattern->Run(std::string(5000, 'a')));
+}
+
+TEST_F(CountingNFATest, OverlappingCounts) {
+  auto const status_or_pattern = Parse("(a.{101}){2}", flags());
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  auto const counting_nfa = dynamic_cast<CountingNFA const*>(pattern.get());
+  ASSERT_NE(counting_nfa, nullptr);
+  EXPECT_EQ(counting_nfa->num_counters(), 2);
+  std::string const piece = "a" + std::string(101, 'a');
+  EXPECT_TRUE(pattern->Run(piece + piece));
+  EXPECT_FALSE(pattern->Run(piece + piece + "a"));
+  EXPECT_FALSE(pattern->Run(piece + piece.substr(1)));
+}
+
+TEST_F(CountingNFATest, SmallRepetitionsAreUnrolled) {
+  auto const status_or_pattern = Parse("a.{0,100}b");
+  EXPECT_OK(status_or_pattern);
+  EXPECT_EQ(dynamic_cast<CountingNFA const*>(status_or_pattern.value().get()), nullptr);
+}
+
+TEST_F(CountingNFATest, LargeRepetitionsAreUnrolledIfTheDFAFits) {
+  auto const status_or_pattern = Parse("[a-f0-9]{101}.*");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_EQ(dynamic_cast<CountingNFA const*>(pattern.get()), nullptr);
+  EXPECT_TRUE(pattern->Run(std::string(101, 'a') + "xyz"));
+  EXPECT_FALSE(pattern->Run(std::string(100, 'a') + "xyz"));
+}
+
+TEST_F(CountingNFATest, LargeRepetitionsAreCountedIfTheDFADoesntFit) {
+  auto const status_or_pattern = Parse("(a|b)*a[ab]{200}");
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  EXPECT_NE(dynamic_cast<CountingNFA const*>(pattern.get()), nullptr);
+  EXPECT_TRUE(pattern->Run("ba" + std::string(200, 'b')));
+  EXPECT_FALSE(pattern->Run("ab" + std::string(200, 'b')));
+}
+
+// Forwards to the default resource and keeps track of the bytes currently allocated.
+class CountingResource : public std::pmr::memory_resource {
+ public:
+  size_t bytes_in_use() const { return bytes_in_use_; }
+
+ private:
+  void* do_allocate(size_t const bytes, size_t const alignment) override {
+    bytes_in_use_ += bytes;
+    return std::pmr::get_default_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* const p, size_t const bytes, size_t const alignment) override {
+    bytes_in_use_ -= bytes;
+    std::pmr::get_default_resource()->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {
+    return this == &other;
+  }
+
+  size_t bytes_in_use_ = 0;
+};
+
+class MemoryResourceTest : public TestWithParam<std::optional<Engine>> {
+ protected:
+  explicit MemoryResourceTest() { TempNFA::force_engine_for_testing = GetParam(); }
+  ~MemoryResourceTest() { TempNFA::force_engine_for_testing = std::nullopt; }
+};
+
+TEST_P(MemoryResourceTest, TablesAllocatedFromResource) {
+  CountingResource resource;
+  auto status_or_pattern = Parse("(a|b)*a(a|b)(a|b)", {}, &resource);
+  EXPECT_OK(status_or_pattern);
+  auto& pattern = status_or_pattern.value();
+  EXPECT_GT(resource.bytes_in_use(), 0);
+  EXPECT_TRUE(pattern->Run("baab"));
+  EXPECT_FALSE(pattern->Run("abba"));
+  EXPECT_GE(pattern->GetMemoryUsage(), resource.bytes_in_use());
+  pattern.reset();
+  EXPECT_EQ(resource.bytes_in_use(), 0);
+}
+
+TEST_P(MemoryResourceTest, CloneUsesSameResource) {
+  CountingResource resource;
+  auto const status_or_pattern = Parse("(a|b)*a(a|b)(a|b)", {}, &resource);
+  EXPECT_OK(status_or_pattern);
+  auto const& pattern = status_or_pattern.value();
+  size_t const bytes_in_use = resource.bytes_in_use();
+  auto clone = pattern->Clone();
+  EXPECT_GT(resource.bytes_in_use(), bytes_in_use);
+  EXPECT_TRUE(clone->Run("baab"));
+  clone.reset();
+  EXPECT_EQ(resource.bytes_in_use(), bytes_in_use);
+}
+
+TEST_P(MemoryResourceTest, CountingNFA) {
+  CountingResource resource;
+  auto status_or_pattern = Parse("a.{0,1000}b", {}, &resource);
+  EXPECT_OK(status_or_pattern);
+  auto& pattern = status_or_pattern.value();
+  EXPECT_GT(resource.bytes_in_use(), 0);
+  EXPECT_TRUE(pattern->Run("a" + std::string(1000, 'b') + "b"));
+  EXPECT_GE(pattern->GetMemoryUsage(), resource.bytes_in_use());
+  pattern.reset();
+  EXPECT_EQ(resource.bytes_in_use(), 0);
+}
+
+TEST_P(MemoryResourceTest, MemoryUsageGrowsWithPattern) {
+  auto const status_or_small = Parse("(a|b)*a(a|b)");
+  EXPECT_OK(status_or_small);
+  auto const status_or_large = Parse("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)");
+  EXPECT_OK(status_or_large);
+  EXPECT_LT(status_or_small.value()->GetMemoryUsage(), status_or_large.value()->GetMemoryUsage());
+}
+
+INSTANTIATE_TEST_SUITE_P(MemoryResourceTest, MemoryResourceTest,
+                         Values(std::nullopt, Engine::kNFA, Engine::kShiftAnd, Engine::kLazyDFA));
+
+TEST(CountingSetTest, IncrementAndExit) {
+  CountingSet set{2, 3};
+  EXPECT_TRUE(set.empty());
+  set.InsertOne();
+  EXPECT_FALSE(set.CanExit());
+  set.Increment();
+  EXPECT_TRUE(set.CanExit());
+  set.InsertOne();
+  set.Increment();
+  EXPECT_TRUE(set.CanExit());
+  set.Increment();
+  EXPECT_TRUE(set.CanExit());
+  set.Increment();
+  EXPECT_FALSE(set.CanExit());
+  EXPECT_TRUE(set.empty());
+  set.InsertOne();
+  set.Clear();
+  EXPECT_TRUE(set.empty());
+}
+
+class SimplifyTest : public ::testing::Test {
+ protected:
+  ASTNode* MakeCharacter(char const ch) {
+    return ast_.MakeCharacterClass(std::bitset<256>().set(ch));
+  }
+
+  ASTNode* MakeLiteral(std::string_view const literal) {
+    std::vector<ASTNode*> children;
+    for (char const ch : literal) {
+      children.push_back(MakeCharacter(ch));
+    }
+    return ast_.MakeConcatenation(std::move(children));
+  }
+
+  ASTNode* Simplify(ASTNode* const root) {
+    ast_.set_root(root);
+    SimplifyAST(&ast_);
+    return ast_.root();
+  }
+
+  AST ast_;
+};
+
+TEST_F(SimplifyTest, MergeCharacterAlternation) {
+  auto const root = Simplify(
+      ast_.MakeAlternation({MakeCharacter('a'), MakeCharacter('b'), MakeCharacter('c')}));
+  EXPECT_EQ(root->kind, ASTNode::Kind::kCharacterClass);
+  EXPECT_EQ(root->chars, std::bitset<256>().set('a').set('b').set('c'));
+}
+
+TEST_F(SimplifyTest, FactorPrefix) {
+  auto const root = Simplify(ast_.MakeAlternation({MakeLiteral("abc"), MakeLiteral("abd")}));
+  ASSERT_EQ(root->kind, ASTNode::Kind::kConcatenation);
+  ASSERT_EQ(root->children.size(), 3);
+  EXPECT_EQ(root->children[0]->chars, std::bitset<256>().set('a'));
+  EXPECT_EQ(root->children[1]->chars, std::bitset<256>().set('b'));
+  EXPECT_EQ(root->children[2]->chars, std::bitset<256>().set('c').set('d'));
+}
+
+TEST_F(SimplifyTest, FactorSuffix) {
+  auto const root = Simplify(ast_.MakeAlternation({MakeLiteral("ac"), MakeLiteral("bc")}));
+  ASSERT_EQ(root->kind, ASTNode::Kind::kConcatenation);
+  ASSERT_EQ(root->children.size(), 2);
+  EXPECT_EQ(root->children[0]->chars, std::bitset<256>().set('a').set('b'));
+  EXPECT_EQ(root->children[1]->chars, std::bitset<256>().set('c'));
+}
+
+TEST_F(SimplifyTest, EmptyBranch) {
+  auto const root = Simplify(ast_.MakeAlternation({MakeLiteral("ab"), ast_.MakeEmpty()}));
+  ASSERT_EQ(root->kind, ASTNode::Kind::kRepetition);
+  EXPECT_EQ(root->min, 0);
+  EXPECT_EQ(root->max, 1);
+  EXPECT_EQ(root->children[0]->kind, ASTNode::Kind::kConcatenation);
+}
+
+TEST_F(SimplifyTest, DeadBranch) {
+  auto const dead = ast_.MakeCharacterClass(std::bitset<256>());
+  auto const root = Simplify(ast_.MakeAlternation(
+      {MakeCharacter('a'), ast_.MakeConcatenation({dead, MakeCharacter('b')})}));
+  EXPECT_EQ(root->kind, ASTNode::Kind::kCharacterClass);
+  EXPECT_EQ(root->chars, std::bitset<256>().set('a'));
+}
+
+TEST_F(SimplifyTest, NestedRepetitions) {
+  auto const root1 =
+      Simplify(ast_.MakeRepetition(ast_.MakeRepetition(MakeCharacter('x'), 0, -1), 0, -1));
+  ASSERT_EQ(root1->kind, ASTNode::Kind::kRepetition);
+  EXPECT_EQ(root1->min, 0);
+  EXPECT_EQ(root1->max, -1);
+  EXPECT_EQ(root1->children[0]->kind, ASTNode::Kind::kCharacterClass);
+  auto const root2 =
+      Simplify(ast_.MakeRepetition(ast_.MakeRepetition(MakeCharacter('x'), 1, -1), 0, 1));
+  ASSERT_EQ(root2->kind, ASTNode::Kind::kRepetition);
+  EXPECT_EQ(root2->min, 0);
+  EXPECT_EQ(root2->max, -1);
+  EXPECT_EQ(root2->children[0]->kind, ASTNode::Kind::kCharacterClass);
+  auto const root3 =
+      Simplify(ast_.MakeRepetition(ast_.MakeRepetition(MakeCharacter('x'), 2, 2), 3, 3));
+  ASSERT_EQ(root3->kind, ASTNode::Kind::kRepetition);
+  EXPECT_EQ(root3->min, 6);
+  EXPECT_EQ(root3->max, 6);
+  EXPECT_EQ(root3->children[0]->kind, ASTNode::Kind::kCharacterClass);
+}
+
+TEST_F(SimplifyTest, NonContiguousNestedRepetitions) {
+  // `(x{2}){1,2}` matches `xx` and `xxxx` but not `xxx`.
+  auto const root =
+      Simplify(ast_.MakeRepetition(ast_.MakeRepetition(MakeCharacter('x'), 2, 2), 1, 2));
+  ASSERT_EQ(root->kind, ASTNode::Kind::kRepetition);
+  EXPECT_EQ(root->min, 1);
+  EXPECT_EQ(root->max, 2);
+  EXPECT_EQ(root->children[0]->kind, ASTNode::Kind::kRepetition);
+}
+
+TEST(PrefilterTest, Literal) {
+  Prefilter const prefilter{"abc", std::bitset<256>()};
+  EXPECT_FALSE(prefilter.empty());
+  EXPECT_EQ(prefilter.FindCandidate("xxababcab", 0), 4);
+  EXPECT_EQ(prefilter.FindCandidate("xxababcab", 4), 4);
+  EXPECT_EQ(prefilter.FindCandidate("xxababcab", 5), std::string_view::npos);
+  EXPECT_EQ(prefilter.FindCandidate("ab", 0), std::string_view::npos);
+  EXPECT_EQ(prefilter.FindCandidate("", 0), std::string_view::npos);
+}
+
+TEST(PrefilterTest, FirstBytes) {
+  Prefilter const prefilter{"", std::bitset<256>().set('x').set('y')};
+  EXPECT_FALSE(prefilter.empty());
+  EXPECT_EQ(prefilter.FindCandidate("abcyx", 0), 3);
+  EXPECT_EQ(prefilter.FindCandidate("abcyx", 4), 4);
+  EXPECT_EQ(prefilter.FindCandidate("abcyx", 5), std::string_view::npos);
+  EXPECT_EQ(prefilter.FindCandidate("abc", 0), std::string_view::npos);
+}
+
+TEST(PrefilterTest, Empty) {
+  EXPECT_TRUE(Prefilter().empty());
+  EXPECT_EQ(Prefilter().FindCandidate("abc", 1), 1);
+  Prefilter const prefilter{"", std::bitset<256>().set('a').set('b').set('c').set('d')};
+  EXPECT_TRUE(prefilter.empty());
+  EXPECT_EQ(prefilter.FindCandidate("xyz", 0), 0);
+}
+
+TEST(PrefilterTest, BuildFromPattern) {
+  auto const literal = [](std::string_view const pattern) {
+    return std::string(re3::Compile(pattern).value().prefilter.literal());
+  };
+  EXPECT_EQ(literal("lorem"), "lorem");
+  EXPECT_EQ(literal("ERROR: \\d+"), "ERROR: ");
+  EXPECT_EQ(literal("lorem|lorax"), "lor");
+  EXPECT_EQ(literal("(ab){2}c"), "ababc");
+  EXPECT_EQ(literal("(ab){2,}c"), "abab");
+  EXPECT_EQ(literal("a+b"), "a");
+  EXPECT_EQ(literal("ab?c"), "a");
+  EXPECT_EQ(literal("[ab]c"), "");
+  EXPECT_EQ(literal("x{100}"), std::string(Prefilter::kMaxLiteralLength, 'x'));
+  EXPECT_TRUE(re3::Compile("a*").value().prefilter.empty());
+  EXPECT_TRUE(re3::Compile("\\w+").value().prefilter.empty());
+  auto const first_bytes = re3::Compile("a?[bc]d").value().prefilter;
+  EXPECT_EQ(first_bytes.literal(), "");
+  EXPECT_EQ(first_bytes.FindCandidate("xxcd", 0), 2);
+}
+
+TEST(SparseSetTest, InsertAndClear) {
+  SparseSet set{10};
+  EXPECT_TRUE(set.empty());
+  EXPECT_TRUE(set.Insert(7));
+  EXPECT_TRUE(set.Insert(2));
+  EXPECT_FALSE(set.Insert(7));
+  EXPECT_EQ(set.size(), 2);
+  EXPECT_TRUE(set.Contains(2));
+  EXPECT_TRUE(set.Contains(7));
+  EXPECT_FALSE(set.Contains(0));
+  EXPECT_THAT(set, ElementsAre(7, 2));
+  set.Clear();
+  EXPECT_TRUE(set.empty());
+  EXPECT_FALSE(set.Contains(7));
+  EXPECT_TRUE(set.Insert(0));
+  EXPECT_THAT(set, ElementsAre(0));
+}
 
 }  // namespace
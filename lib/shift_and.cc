@@ -0,0 +1,204 @@
+#include "lib/shift_and.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "lib/automaton.h"
+#include "lib/nfa.h"
+
+namespace re3 {
+
+template <int kNumWords>
+ShiftAnd<kNumWords>::ShiftAnd(std::vector<Bits> const &follow, std::array<Bits, 256> const &masks,
+                              Bits const &final_positions,
+                              std::pmr::memory_resource *const resource)
+    : num_positions_(follow.size()),
+      num_chunks_((num_positions_ + kChunkBits - 1) / kChunkBits),
+      follow_tables_(num_chunks_ * 256, Bits{}, resource),
+      masks_(masks),
+      final_positions_(final_positions) {
+  for (int chunk = 0; chunk < num_chunks_; ++chunk) {
+    Bits *const table = &follow_tables_[chunk * 256];
+    for (int bits = 1; bits < 256; ++bits) {
+      // Every entry is the union of the entry without the lowest bit and the follow set of the
+      // position corresponding to that bit.
+      int const lowest = __builtin_ctz(bits);
+      int const position = chunk * kChunkBits + lowest;
+      Bits const &rest = table[bits & (bits - 1)];
+      for (int i = 0; i < kNumWords; ++i) {
+        table[bits][i] = rest[i] | (position < num_positions_ ? follow[position][i] : 0);
+      }
+    }
+  }
+}
+
+template <int kNumWords>
+std::unique_ptr<AutomatonInterface> ShiftAnd<kNumWords>::Clone() const {
+  return std::make_unique<ShiftAnd>(*this);
+}
+
+template <int kNumWords>
+bool ShiftAnd<kNumWords>::Run(std::string_view const input) const {
+  Bits active{};
+  active[0] = 1;
+  for (uint8_t const ch : input) {
+    if (!Step(&active, ch)) {
+      return false;
+    }
+  }
+  return IsAccepting(active);
+}
+
+template <int kNumWords>
+std::optional<size_t> ShiftAnd<kNumWords>::MatchPrefix(std::string_view const input,
+                                                       PrefixLength const length) const {
+  return MatchImpl<false>(input, length);
+}
+
+template <int kNumWords>
+std::optional<size_t> ShiftAnd<kNumWords>::MatchSuffix(std::string_view const input,
+                                                       PrefixLength const length) const {
+  return MatchImpl<true>(input, length);
+}
+
+template <int kNumWords>
+template <bool kReverse>
+std::optional<size_t> ShiftAnd<kNumWords>::MatchImpl(std::string_view const input,
+                                                     PrefixLength const length) const {
+  Bits active{};
+  active[0] = 1;
+  std::optional<size_t> result;
+  for (size_t i = 0;; ++i) {
+    if (IsAccepting(active)) {
+      result = i;
+      if (length == PrefixLength::kShortest) {
+        return result;
+      }
+    }
+    if (i == input.size() || !Step(&active, GetCharacter<kReverse>(input, i))) {
+      return result;
+    }
+  }
+}
+
+template <int kNumWords>
+size_t ShiftAnd<kNumWords>::GetMemoryUsage() const {
+  return sizeof(ShiftAnd) + GetAllocatedBytes(follow_tables_);
+}
+
+template <int kNumWords>
+bool ShiftAnd<kNumWords>::Step(Bits *const active, uint8_t const ch) const {
+  Bits next{};
+  for (int chunk = 0; chunk < num_chunks_; ++chunk) {
+    auto const bits = ((*active)[chunk / 8] >> (chunk % 8 * kChunkBits)) & 0xFF;
+    Bits const &follow = follow_tables_[chunk * 256 + bits];
+    for (int i = 0; i < kNumWords; ++i) {
+      next[i] |= follow[i];
+    }
+  }
+  uint64_t any = 0;
+  for (int i = 0; i < kNumWords; ++i) {
+    (*active)[i] = next[i] & masks_[ch][i];
+    any |= (*active)[i];
+  }
+  return any != 0;
+}
+
+template <int kNumWords>
+bool ShiftAnd<kNumWords>::IsAccepting(Bits const &active) const {
+  for (int i = 0; i < kNumWords; ++i) {
+    if (active[i] & final_positions_[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template class ShiftAnd<1>;
+template class ShiftAnd<2>;
+
+namespace {
+
+// A set of characters, one bit per character.
+using CharSet = std::array<uint64_t, 4>;
+
+// A position of the Glushkov automaton: the NFA state it enters and the characters leading to it.
+using Position = std::pair<int32_t, CharSet>;
+
+template <int kNumWords>
+std::unique_ptr<AutomatonInterface> MakeShiftAndImpl(
+    NFA const &nfa, std::vector<Position> const &positions,
+    std::vector<std::vector<int>> const &source_positions) {
+  using Bits = typename ShiftAnd<kNumWords>::Bits;
+  std::vector<Bits> follow(positions.size(), Bits{});
+  std::array<Bits, 256> masks{};
+  Bits final_positions{};
+  for (int position = 0; position < positions.size(); ++position) {
+    auto const &[state, chars] = positions[position];
+    for (auto const closure_state : nfa.EpsilonClosure(state)) {
+      for (auto const next : source_positions[closure_state]) {
+        follow[position][next / 64] |= uint64_t{1} << (next % 64);
+      }
+      if (closure_state == nfa.final_state()) {
+        final_positions[position / 64] |= uint64_t{1} << (position % 64);
+      }
+    }
+    for (int ch = 0; ch < 256; ++ch) {
+      if (chars[ch / 64] & (uint64_t{1} << (ch % 64))) {
+        masks[ch][position / 64] |= uint64_t{1} << (position % 64);
+      }
+    }
+  }
+  return std::make_unique<ShiftAnd<kNumWords>>(follow, masks, final_positions, nfa.resource());
+}
+
+}  // namespace
+
+std::unique_ptr<AutomatonInterface> MakeShiftAnd(NFA const &nfa, size_t const max_positions) {
+  if (max_positions < 1) {
+    return nullptr;
+  }
+  // Position 0 is the initial one. Its character set is empty because it's never entered.
+  std::vector<Position> positions{{nfa.initial_state(), CharSet{}}};
+  absl::flat_hash_map<Position, int> position_ids;
+  std::vector<std::vector<int>> source_positions(nfa.num_states());
+  for (int32_t state = 0; state < nfa.num_states(); ++state) {
+    // Several edges may lead to the same target (e.g. for the ranges of `\w`), their characters are
+    // gathered in a single position.
+    absl::flat_hash_map<int32_t, CharSet> target_chars;
+    for (auto const &edge : nfa.edges(state)) {
+      for (auto const target : nfa.targets(edge)) {
+        auto &chars = target_chars[target];
+        for (int ch = edge.first; ch <= edge.last; ++ch) {
+          chars[ch / 64] |= uint64_t{1} << (ch % 64);
+        }
+      }
+    }
+    for (auto &[target, chars] : target_chars) {
+      Position position{target, chars};
+      auto const [it, inserted] = position_ids.try_emplace(position, positions.size());
+      if (inserted) {
+        if (positions.size() >= max_positions || positions.size() >= ShiftAnd<2>::kMaxPositions) {
+          return nullptr;
+        }
+        positions.push_back(std::move(position));
+      }
+      source_positions[state].push_back(it->second);
+    }
+  }
+  if (positions.size() <= ShiftAnd<1>::kMaxPositions) {
+    return MakeShiftAndImpl<1>(nfa, positions, source_positions);
+  } else {
+    return MakeShiftAndImpl<2>(nfa, positions, source_positions);
+  }
+}
+
+}  // namespace re3
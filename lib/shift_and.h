@@ -0,0 +1,114 @@
+#ifndef __RE3_LIB_SHIFT_AND_H__
+#define __RE3_LIB_SHIFT_AND_H__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "lib/automaton.h"
+#include "lib/nfa.h"
+
+namespace re3 {
+
+// Runs a small non-deterministic automaton with a bit-parallel simulation of its Glushkov (aka
+// position) automaton, generalizing the Shift-And algorithm to arbitrary regular expressions.
+//
+// Every position corresponds to a state of the NFA that is entered by reading a character from a
+// specific set, so all transitions into a position are labeled alike. Position 0 is the initial one
+// and is never entered. The set of active positions is a bit mask of `kNumWords` 64-bit words, and
+// every step computes:
+//
+//   active = Follow(active) & masks[ch]
+//
+// where `masks[ch]` has the bits of the positions entered by reading `ch`. `Follow` is the union of
+// the follow sets of the active positions and is computed from precomputed tables, one table per
+// group of 8 positions, indexed by the 8 corresponding bits of the mask. So a step takes one table
+// lookup per 8 positions and a handful of bitwise operations, with no allocations and no branches
+// other than the loops.
+template <int kNumWords>
+class ShiftAnd final : public AutomatonInterface {
+ public:
+  static_assert(kNumWords > 0);
+
+  using Bits = std::array<uint64_t, kNumWords>;
+
+  // Maximum number of positions supported by this class.
+  static inline int constexpr kMaxPositions = kNumWords * 64;
+
+  // `follow` must have one element per position with the set of positions that can be entered right
+  // after that position, `masks` has the set of positions that can be entered by reading each
+  // character, and `final_positions` has the accepting positions. The follow tables are allocated
+  // from `resource`.
+  explicit ShiftAnd(std::vector<Bits> const &follow, std::array<Bits, 256> const &masks,
+                    Bits const &final_positions, std::pmr::memory_resource *resource);
+
+  // Copies allocate their tables from the same memory resource as the original.
+  ShiftAnd(ShiftAnd const &other)
+      : num_positions_(other.num_positions_),
+        num_chunks_(other.num_chunks_),
+        follow_tables_(other.follow_tables_, other.follow_tables_.get_allocator()),
+        masks_(other.masks_),
+        final_positions_(other.final_positions_) {}
+
+  ShiftAnd &operator=(ShiftAnd const &) = default;
+  ShiftAnd(ShiftAnd &&) noexcept = default;
+  ShiftAnd &operator=(ShiftAnd &&) noexcept = default;
+
+  int num_positions() const { return num_positions_; }
+
+  std::unique_ptr<AutomatonInterface> Clone() const override;
+
+  bool Run(std::string_view input) const override;
+
+  std::optional<size_t> MatchPrefix(std::string_view input, PrefixLength length) const override;
+
+  std::optional<size_t> MatchSuffix(std::string_view input, PrefixLength length) const override;
+
+  size_t GetMemoryUsage() const override;
+
+ private:
+  // Shared implementation of `MatchPrefix` and `MatchSuffix`.
+  template <bool kReverse>
+  std::optional<size_t> MatchImpl(std::string_view input, PrefixLength length) const;
+
+  // Number of positions whose follow sets are looked up together.
+  static inline int constexpr kChunkBits = 8;
+
+  // Computes the positions that are active after reading `ch` with the positions in `active`, and
+  // returns false iff there are none.
+  bool Step(Bits *active, uint8_t ch) const;
+
+  // Returns true iff any of the `active` positions is accepting.
+  bool IsAccepting(Bits const &active) const;
+
+  int num_positions_;
+  int num_chunks_;
+
+  // `follow_tables_[c * 256 + b]` is the union of the follow sets of the positions `8 * c + i` for
+  // every bit `i` set in `b`.
+  std::pmr::vector<Bits> follow_tables_;
+
+  std::array<Bits, 256> masks_;
+  Bits final_positions_;
+};
+
+extern template class ShiftAnd<1>;
+extern template class ShiftAnd<2>;
+
+// Builds the position automaton of `nfa` and returns a `ShiftAnd` running it, or nullptr if the
+// automaton has more than `max_positions` positions or more than `ShiftAnd<2>` supports. The tables
+// are allocated from the same memory resource as those of `nfa`.
+//
+// Every labeled edge of `nfa` yields a position identified by its target state and the full set of
+// characters leading from its source state to that target, so positions shared by several states
+// are only counted once.
+std::unique_ptr<AutomatonInterface> MakeShiftAnd(NFA const &nfa, size_t max_positions);
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_SHIFT_AND_H__
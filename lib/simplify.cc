@@ -0,0 +1,273 @@
+#include "lib/simplify.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "lib/ast.h"
+
+namespace re3 {
+
+namespace {
+
+// Combining nested repetitions never yields bounds larger than this, which is also the largest
+// numeric quantifier accepted by the parser. Larger combinations are left nested.
+int64_t constexpr kMaxCombinedRepetitionBound = 100000;
+
+// Checks whether `node` matches nothing. Simplified subtrees that match nothing are always reduced
+// to a class without characters, so this doesn't need to look any deeper.
+bool IsDead(ASTNode const &node) {
+  return node.kind == ASTNode::Kind::kCharacterClass && node.chars.none();
+}
+
+// Checks whether two subtrees are structurally identical.
+bool Equal(ASTNode const &lhs, ASTNode const &rhs) {
+  if (lhs.kind != rhs.kind || lhs.chars != rhs.chars || lhs.min != rhs.min ||
+      lhs.max != rhs.max || lhs.children.size() != rhs.children.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < lhs.children.size(); ++i) {
+    if (!Equal(*lhs.children[i], *rhs.children[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the operands of `node` seen as a concatenation: the children of a concatenation, no
+// operands for the empty string, or `node` itself otherwise.
+std::vector<ASTNode *> ToSequence(ASTNode *const node) {
+  if (node->kind == ASTNode::Kind::kConcatenation) {
+    return {node->children.begin(), node->children.end()};
+  } else if (node->kind == ASTNode::Kind::kEmpty) {
+    return {};
+  } else {
+    return {node};
+  }
+}
+
+class Simplifier {
+ public:
+  explicit Simplifier(AST *const ast) : ast_(ast) {}
+
+  ASTNode *Simplify(ASTNode *node);
+
+ private:
+  // Returns a character class without characters, which matches nothing.
+  ASTNode *MakeDead() { return ast_->MakeCharacterClass(std::bitset<256>()); }
+
+  // The inverse of `ToSequence`.
+  ASTNode *FromSequence(std::vector<ASTNode *> sequence);
+
+  // The following functions simplify a node whose children have already been simplified.
+  ASTNode *SimplifyRepetition(ASTNode *node);
+  ASTNode *SimplifyConcatenation(ASTNode *node);
+  ASTNode *SimplifyAlternation(ASTNode *node);
+
+  // Groups `branches` by their first operand (or by their last one if `suffixes` is true) and
+  // factors the longest common prefix (or suffix) out of every group of two or more branches, e.g.
+  // `abc|abd|e` becomes `ab(c|d)|e`. The remainders of every group are simplified again, so they're
+  // factored recursively where they still share operands (e.g. `abc|abd|ae` becomes `a(b[cd]|e)`).
+  std::vector<ASTNode *> FactorBranches(std::vector<ASTNode *> branches, bool suffixes);
+
+  AST *const ast_;
+};
+
+ASTNode *Simplifier::FromSequence(std::vector<ASTNode *> sequence) {
+  if (sequence.empty()) {
+    return ast_->MakeEmpty();
+  } else if (sequence.size() == 1) {
+    return sequence[0];
+  } else {
+    return ast_->MakeConcatenation(sequence);
+  }
+}
+
+ASTNode *Simplifier::SimplifyRepetition(ASTNode *const node) {
+  auto const child = node->children[0];
+  if (node->max == 0 || child->kind == ASTNode::Kind::kEmpty) {
+    return ast_->MakeEmpty();
+  }
+  if (IsDead(*child)) {
+    return node->min > 0 ? child : ast_->MakeEmpty();
+  }
+  if (node->min == 1 && node->max == 1) {
+    return child;
+  }
+  if (child->kind == ASTNode::Kind::kRepetition) {
+    // `(x{a,b}){c,d}` matches `x{k*a,k*b}` for every `k` in `[c,d]`, so it's equivalent to
+    // `x{c*a,d*b}` iff those ranges leave no gaps between each other. The gap between the ranges
+    // of `k` and `k+1` only shrinks as `k` grows, so it's enough to check the first one.
+    int64_t const a = child->min;
+    int64_t const b = child->max;
+    int64_t const c = node->min;
+    int64_t const d = node->max;
+    bool const contiguous = c == d || (b < 0 ? c > 0 || a <= 1 : a <= c * (b - a) + 1);
+    int64_t const min = c * a;
+    int64_t const max = b < 0 || d < 0 ? -1 : d * b;
+    if (contiguous && min <= kMaxCombinedRepetitionBound && max <= kMaxCombinedRepetitionBound) {
+      node->min = min;
+      node->max = max;
+      node->children[0] = child->children[0];
+      return SimplifyRepetition(node);
+    }
+  }
+  return node;
+}
+
+ASTNode *Simplifier::SimplifyConcatenation(ASTNode *const node) {
+  std::vector<ASTNode *> children;
+  children.reserve(node->children.size());
+  for (auto const child : node->children) {
+    if (IsDead(*child)) {
+      return child;
+    } else if (child->kind == ASTNode::Kind::kConcatenation) {
+      children.insert(children.end(), child->children.begin(), child->children.end());
+    } else if (child->kind != ASTNode::Kind::kEmpty) {
+      children.push_back(child);
+    }
+  }
+  return FromSequence(std::move(children));
+}
+
+std::vector<ASTNode *> Simplifier::FactorBranches(std::vector<ASTNode *> branches,
+                                                  bool const suffixes) {
+  std::vector<std::vector<ASTNode *>> sequences;
+  sequences.reserve(branches.size());
+  for (auto const branch : branches) {
+    sequences.push_back(ToSequence(branch));
+  }
+  // Returns the i-th operand of `sequence` from the start, or from the end if `suffixes` is true.
+  auto const get_operand = [suffixes](std::vector<ASTNode *> const &sequence, size_t const i) {
+    return suffixes ? sequence[sequence.size() - 1 - i] : sequence[i];
+  };
+  // The indices of the sequences in every group, in order of first appearance.
+  std::vector<std::vector<size_t>> groups;
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    auto const it = std::find_if(groups.begin(), groups.end(), [&](auto const &group) {
+      return !sequences[i].empty() && !sequences[group[0]].empty() &&
+             Equal(*get_operand(sequences[group[0]], 0), *get_operand(sequences[i], 0));
+    });
+    if (it != groups.end()) {
+      it->push_back(i);
+    } else {
+      groups.push_back({i});
+    }
+  }
+  std::vector<ASTNode *> results;
+  results.reserve(groups.size());
+  for (auto const &group : groups) {
+    auto const &first = sequences[group[0]];
+    if (group.size() < 2) {
+      results.push_back(FromSequence(first));
+      continue;
+    }
+    size_t common_size = 1;
+    while (std::all_of(group.begin(), group.end(), [&](size_t const index) {
+      auto const &sequence = sequences[index];
+      return sequence.size() > common_size &&
+             Equal(*get_operand(sequence, common_size), *get_operand(first, common_size));
+    })) {
+      ++common_size;
+    }
+    std::vector<ASTNode *> remainders;
+    remainders.reserve(group.size());
+    for (auto const index : group) {
+      auto const &sequence = sequences[index];
+      if (suffixes) {
+        remainders.push_back(FromSequence({sequence.begin(), sequence.end() - common_size}));
+      } else {
+        remainders.push_back(FromSequence({sequence.begin() + common_size, sequence.end()}));
+      }
+    }
+    auto const alternation = SimplifyAlternation(ast_->MakeAlternation(remainders));
+    std::vector<ASTNode *> operands;
+    operands.reserve(common_size + 1);
+    if (suffixes) {
+      operands.push_back(alternation);
+      operands.insert(operands.end(), first.end() - common_size, first.end());
+    } else {
+      operands.insert(operands.end(), first.begin(), first.begin() + common_size);
+      operands.push_back(alternation);
+    }
+    results.push_back(SimplifyConcatenation(ast_->MakeConcatenation(operands)));
+  }
+  return results;
+}
+
+ASTNode *Simplifier::SimplifyAlternation(ASTNode *const node) {
+  bool optional = false;
+  // Adds `branch` to `branches`, flattening nested alternations and dropping the branches that
+  // match nothing or only the empty string. The latter make the whole alternation optional.
+  auto const add_branch = [&optional](ASTNode *const branch,
+                                      std::vector<ASTNode *> *const branches) {
+    if (branch->kind == ASTNode::Kind::kEmpty) {
+      optional = true;
+    } else if (branch->kind == ASTNode::Kind::kAlternation) {
+      branches->insert(branches->end(), branch->children.begin(), branch->children.end());
+    } else if (!IsDead(*branch)) {
+      branches->push_back(branch);
+    }
+  };
+  std::vector<ASTNode *> branches;
+  for (auto const child : node->children) {
+    add_branch(child, &branches);
+  }
+  branches = FactorBranches(std::move(branches), /*suffixes=*/false);
+  branches = FactorBranches(std::move(branches), /*suffixes=*/true);
+  std::vector<ASTNode *> factored = std::move(branches);
+  branches.clear();
+  for (auto const branch : factored) {
+    add_branch(branch, &branches);
+  }
+  // Merge all single characters and character classes into the first one.
+  ASTNode *merged_class = nullptr;
+  std::vector<ASTNode *> results;
+  results.reserve(branches.size());
+  for (auto const branch : branches) {
+    if (branch->kind != ASTNode::Kind::kCharacterClass) {
+      results.push_back(branch);
+    } else if (merged_class) {
+      merged_class->chars |= branch->chars;
+    } else {
+      merged_class = branch;
+      results.push_back(branch);
+    }
+  }
+  if (results.empty()) {
+    return optional ? ast_->MakeEmpty() : MakeDead();
+  }
+  auto const result = results.size() > 1 ? ast_->MakeAlternation(results) : results[0];
+  if (optional) {
+    return SimplifyRepetition(ast_->MakeRepetition(result, 0, 1));
+  } else {
+    return result;
+  }
+}
+
+ASTNode *Simplifier::Simplify(ASTNode *const node) {
+  for (auto &child : node->children) {
+    child = Simplify(child);
+  }
+  switch (node->kind) {
+    case ASTNode::Kind::kEmpty:
+    case ASTNode::Kind::kCharacterClass:
+      return node;
+    case ASTNode::Kind::kConcatenation:
+      return SimplifyConcatenation(node);
+    case ASTNode::Kind::kAlternation:
+      return SimplifyAlternation(node);
+    case ASTNode::Kind::kRepetition:
+      return SimplifyRepetition(node);
+  }
+  return node;
+}
+
+}  // namespace
+
+void SimplifyAST(AST *const ast) { ast->set_root(Simplifier(ast).Simplify(ast->root())); }
+
+}  // namespace re3
@@ -0,0 +1,28 @@
+#ifndef __RE3_LIB_SIMPLIFY_H__
+#define __RE3_LIB_SIMPLIFY_H__
+
+#include "lib/ast.h"
+
+namespace re3 {
+
+// Rewrites `ast` into an equivalent tree that yields a smaller automaton with any construction. The
+// rewrites are:
+//
+//   * nested concatenations and alternations are flattened, and empty operands of concatenations
+//     are dropped;
+//   * branches that can't match anything are dropped (e.g. `a|[^\x00-\xFF]b` becomes `a`), and so
+//     are concatenations containing them;
+//   * alternation branches that start or end with the same subexpression are factored (e.g.
+//     `abc|abd` becomes `ab(c|d)` and `ac|bc` becomes `(a|b)c`);
+//   * alternation branches that are single characters or character classes are merged into one
+//     class (e.g. `a|b|c` becomes `[abc]`), and empty branches make the alternation optional;
+//   * nested repetitions are combined when the result is equivalent (e.g. `(x*)*` and `(x+)?`
+//     become `x*`, `(x{2}){3}` becomes `x{6}`), and trivial ones are removed (e.g. `x{1}`).
+//
+// Only the set of matched strings is preserved, which is all the automata ever look at. Nodes are
+// rewritten in place where possible, and any new nodes are allocated in `ast`.
+void SimplifyAST(AST *ast);
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_SIMPLIFY_H__
@@ -0,0 +1,66 @@
+#ifndef __RE3_LIB_SPARSE_SET_H__
+#define __RE3_LIB_SPARSE_SET_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace re3 {
+
+// A set of integers in the range `[0, capacity)` with constant-time insertion, lookup and clearing,
+// as described by Briggs and Torczon in "An Efficient Representation for Sparse Sets".
+//
+// Elements are stored in insertion order in a dense array, and a sparse array maps every value to
+// its index in the dense one. A value is in the set iff those two agree, so the content of the
+// sparse array doesn't need to be reset when the set is cleared.
+class SparseSet {
+ public:
+  using value_type = int32_t;
+  using const_iterator = int32_t const *;
+  using iterator = const_iterator;
+
+  explicit SparseSet(size_t const capacity) : dense_(capacity), sparse_(capacity) {}
+
+  SparseSet(SparseSet const &) = default;
+  SparseSet &operator=(SparseSet const &) = default;
+  SparseSet(SparseSet &&) noexcept = default;
+  SparseSet &operator=(SparseSet &&) noexcept = default;
+
+  size_t capacity() const { return dense_.size(); }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const_iterator begin() const { return dense_.data(); }
+  const_iterator end() const { return dense_.data() + size_; }
+
+  bool Contains(int32_t const value) const {
+    auto const index = sparse_[value];
+    return index < size_ && dense_[index] == value;
+  }
+
+  // Returns false if `value` was already in the set.
+  bool Insert(int32_t const value) {
+    if (Contains(value)) {
+      return false;
+    }
+    sparse_[value] = size_;
+    dense_[size_++] = value;
+    return true;
+  }
+
+  void Clear() { size_ = 0; }
+
+  // Returns the number of bytes allocated by the set, not counting the object itself.
+  size_t GetAllocatedBytes() const {
+    return dense_.capacity() * sizeof(int32_t) + sparse_.capacity() * sizeof(uint32_t);
+  }
+
+ private:
+  std::vector<int32_t> dense_;
+  std::vector<uint32_t> sparse_;
+  uint32_t size_ = 0;
+};
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_SPARSE_SET_H__
@@ -1,216 +1,947 @@
 #include "lib/temp.h"
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <memory_resource>
+#include <numeric>
+#include <optional>
 #include <utility>
+#include <vector>
 
-#include "absl/container/btree_map.h"
 #include "absl/container/flat_hash_map.h"
-#include "absl/container/inlined_vector.h"
+#include "absl/container/node_hash_map.h"
+#include "absl/hash/hash.h"
 #include "lib/automaton.h"
+#include "lib/counting_nfa.h"
 #include "lib/dfa.h"
+#include "lib/flags.h"
+#include "lib/lazy_dfa.h"
 #include "lib/nfa.h"
+#include "lib/shift_and.h"
+#include "lib/sparse_set.h"
 
 namespace re3 {
 
-State MakeState(absl::flat_hash_map<uint8_t, absl::InlinedVector<int32_t, 1>> &&edges) {
-  State state;
-  for (auto &[ch, edge] : edges) {
-    state[ch] = std::move(edge);
+namespace {
+
+// Hash maps allocating from a memory resource, used for the scratch data of `TempNFA`.
+template <typename Key, typename Value>
+using FlatHashMap =
+    absl::flat_hash_map<Key, Value, absl::Hash<Key>, std::equal_to<Key>,
+                        std::pmr::polymorphic_allocator<std::pair<Key const, Value>>>;
+template <typename Key, typename Value>
+using NodeHashMap =
+    absl::node_hash_map<Key, Value, absl::Hash<Key>, std::equal_to<Key>,
+                        std::pmr::polymorphic_allocator<std::pair<Key const, Value>>>;
+
+// Sorts a list and removes duplicates.
+template <typename Value>
+void SortAndDeduplicate(std::pmr::vector<Value> *const values) {
+  std::sort(values->begin(), values->end());
+  values->erase(std::unique(values->begin(), values->end()), values->end());
+}
+
+// Returns one character for every byte class, indexed by class.
+std::vector<uint8_t> GetClassRepresentatives(ByteClasses const &byte_classes) {
+  std::vector<uint8_t> representatives;
+  for (int ch = 0; ch < 256; ++ch) {
+    uint8_t const byte_class = byte_classes[ch];
+    if (byte_class >= representatives.size()) {
+      representatives.resize(byte_class + 1);
+    }
+    representatives[byte_class] = ch;
+  }
+  return representatives;
+}
+
+}  // namespace
+
+State MakeState(std::bitset<256> const &chars, int32_t const target,
+                std::pmr::memory_resource *const resource) {
+  State state(resource);
+  int ch = 0;
+  while (ch < 256) {
+    if (!chars[ch]) {
+      ++ch;
+      continue;
+    }
+    int const first = ch;
+    while (ch < 256 && chars[ch]) {
+      ++ch;
+    }
+    state.edges.push_back({static_cast<uint8_t>(first), static_cast<uint8_t>(ch - 1), target});
   }
   return state;
 }
 
-bool TempNFA::force_nfa_for_testing = false;
+TempDFA TempDFA::Minimize() const {
+  // Missing transitions are redirected to an explicit dead state so that every state has a
+  // transition for every class. The dead state gets number `num_states`.
+  int32_t const num_states = final_states_.size();
+  int32_t const dead_state = num_states;
+  auto const target = [&](int32_t const state, int const byte_class) {
+    if (state == dead_state) {
+      return dead_state;
+    }
+    auto const transition = states_[state * num_classes_ + byte_class];
+    return transition < 0 ? dead_state : transition;
+  };
 
-bool TempNFA::IsDeterministic() const {
-  if (force_nfa_for_testing) {
-    return false;
+  // Inverse transitions, stored in compressed rows: the states leading to `state` on class `c` are
+  // `sources[offsets[c * (num_states + 1) + state] ... offsets[c * (num_states + 1) + state + 1]]`.
+  size_t const stride = num_states + 1;
+  std::vector<int32_t> offsets(num_classes_ * stride + 1, 0);
+  for (int32_t state = 0; state <= num_states; ++state) {
+    for (int c = 0; c < num_classes_; ++c) {
+      ++offsets[c * stride + target(state, c) + 1];
+    }
   }
-  for (auto const &[state, edges] : states_) {
-    if (edges[0].size() > 1) {
-      return false;
+  for (size_t i = 1; i < offsets.size(); ++i) {
+    offsets[i] += offsets[i - 1];
+  }
+  std::vector<int32_t> sources(offsets.back());
+  {
+    auto next = offsets;
+    for (int32_t state = 0; state <= num_states; ++state) {
+      for (int c = 0; c < num_classes_; ++c) {
+        sources[next[c * stride + target(state, c)]++] = state;
+      }
     }
-    bool const has_epsilon = !edges[0].empty();
-    for (int ch = 1; ch < 256; ++ch) {
-      auto const &edge = edges[ch];
-      if (edge.size() > 1 || (!edge.empty() && has_epsilon)) {
-        return false;
+  }
+
+  // The partition is represented by a permutation of the states in which every block occupies a
+  // contiguous range.
+  std::vector<int32_t> elements;
+  std::vector<int32_t> locations(num_states + 1);
+  std::vector<int32_t> blocks(num_states + 1);
+  std::vector<int32_t> block_begin;
+  std::vector<int32_t> block_end;
+  for (bool const final : {false, true}) {
+    int32_t const block = block_begin.size();
+    block_begin.push_back(elements.size());
+    for (int32_t state = 0; state <= num_states; ++state) {
+      if ((state < num_states && final_states_[state]) == final) {
+        locations[state] = elements.size();
+        blocks[state] = block;
+        elements.push_back(state);
       }
     }
+    block_end.push_back(elements.size());
+  }
+  if (block_begin[1] == block_end[1]) {
+    block_begin.pop_back();
+    block_end.pop_back();
   }
-  return true;
-}
 
-void TempNFA::RenameState(int const old_name, int const new_name) {
-  auto const it = states_.find(old_name);
-  if (it != states_.end()) {
-    auto node = states_.extract(it);
-    MergeState(new_name, std::move(node.mapped()));
+  // Hopcroft's algorithm: splitters are (block, class) pairs.
+  std::vector<std::pair<int32_t, int>> splitters;
+  std::vector<bool> pending;
+  for (int32_t block = 0; block < block_begin.size(); ++block) {
+    for (int c = 0; c < num_classes_; ++c) {
+      splitters.emplace_back(block, c);
+    }
   }
-  for (auto &[state, edges] : states_) {
-    for (auto &edge : edges) {
-      for (auto &transition : edge) {
-        if (transition == old_name) {
-          transition = new_name;
+  pending.resize(block_begin.size() * num_classes_, true);
+
+  std::vector<int32_t> marked_count(num_states + 1, 0);
+  std::vector<int32_t> touched_blocks;
+  std::vector<int32_t> splitter_states;
+  while (!splitters.empty()) {
+    auto const [splitter, byte_class] = splitters.back();
+    splitters.pop_back();
+    pending[splitter * num_classes_ + byte_class] = false;
+    splitter_states.assign(elements.begin() + block_begin[splitter],
+                           elements.begin() + block_end[splitter]);
+    for (auto const state : splitter_states) {
+      size_t const i = byte_class * stride + state;
+      for (auto j = offsets[i]; j < offsets[i + 1]; ++j) {
+        // Mark the source by moving it to the front of its block.
+        auto const source = sources[j];
+        auto const block = blocks[source];
+        auto const location = locations[source];
+        auto const marked_location = block_begin[block] + marked_count[block];
+        if (location < marked_location) {
+          continue;  // already marked
         }
+        if (marked_count[block]++ == 0) {
+          touched_blocks.push_back(block);
+        }
+        auto const other = elements[marked_location];
+        std::swap(elements[location], elements[marked_location]);
+        locations[other] = location;
+        locations[source] = marked_location;
+      }
+    }
+    for (auto const block : touched_blocks) {
+      auto const marked = marked_count[block];
+      marked_count[block] = 0;
+      if (marked == block_end[block] - block_begin[block]) {
+        continue;
+      }
+      // Split the marked states off into a new block.
+      int32_t const new_block = block_begin.size();
+      block_begin.push_back(block_begin[block]);
+      block_end.push_back(block_begin[block] + marked);
+      block_begin[block] += marked;
+      for (auto i = block_begin[new_block]; i < block_end[new_block]; ++i) {
+        blocks[elements[i]] = new_block;
+      }
+      pending.resize(block_begin.size() * num_classes_, false);
+      bool const new_is_smaller =
+          block_end[new_block] - block_begin[new_block] <= block_end[block] - block_begin[block];
+      for (int c = 0; c < num_classes_; ++c) {
+        if (pending[block * num_classes_ + c] || new_is_smaller) {
+          pending[new_block * num_classes_ + c] = true;
+          splitters.emplace_back(new_block, c);
+        } else {
+          pending[block * num_classes_ + c] = true;
+          splitters.emplace_back(block, c);
+        }
+      }
+    }
+    touched_blocks.clear();
+  }
+
+  // Build the minimized automaton, dropping the block of the dead state.
+  int32_t const dead_block = blocks[dead_state];
+  if (blocks[initial_state_] == dead_block) {
+    return TempDFA(byte_classes_, num_classes_, States(num_classes_, -1), 0, {false});
+  }
+  std::vector<int32_t> new_states(block_begin.size(), -1);
+  int32_t num_new_states = 0;
+  for (int32_t block = 0; block < block_begin.size(); ++block) {
+    if (block != dead_block) {
+      new_states[block] = num_new_states++;
+    }
+  }
+  States states(num_new_states * num_classes_);
+  std::vector<bool> final_states(num_new_states);
+  for (int32_t block = 0; block < block_begin.size(); ++block) {
+    auto const new_state = new_states[block];
+    if (new_state < 0) {
+      continue;
+    }
+    auto const representative = elements[block_begin[block]];
+    final_states[new_state] = final_states_[representative];
+    for (int c = 0; c < num_classes_; ++c) {
+      states[new_state * num_classes_ + c] = new_states[blocks[target(representative, c)]];
+    }
+  }
+  return TempDFA(byte_classes_, num_classes_, std::move(states), new_states[blocks[initial_state_]],
+             std::move(final_states));
+}
+
+bool TempDFA::IsPrefixFree() const {
+  // Look for an accepting state that can be reached from an accepting state by reading at least one
+  // character.
+  std::vector<bool> reached(num_states(), false);
+  std::vector<int32_t> stack;
+  auto const reach_successors = [&](int32_t const state) {
+    for (int c = 0; c < num_classes_; ++c) {
+      auto const transition = states_[state * num_classes_ + c];
+      if (transition >= 0 && !reached[transition]) {
+        reached[transition] = true;
+        stack.push_back(transition);
       }
     }
+  };
+  for (int32_t state = 0; state < num_states(); ++state) {
+    if (final_states_[state]) {
+      reach_successors(state);
+    }
   }
-  if (initial_state_ == old_name) {
-    initial_state_ = new_name;
+  while (!stack.empty()) {
+    auto const state = stack.back();
+    stack.pop_back();
+    if (final_states_[state]) {
+      return false;
+    }
+    reach_successors(state);
+  }
+  return true;
+}
+
+std::unique_ptr<AutomatonInterface> TempDFA::ToDFA(
+    std::pmr::memory_resource *const resource) const {
+  int32_t const num_states = final_states_.size();
+  auto const row = [&](int32_t const state) { return &states_[state * num_classes_]; };
+
+  // Find the states whose outcome is known no matter what follows: those that can't reach any
+  // accepting state are equivalent to the dead state, and accepting states that only loop on
+  // themselves are match states. Minimization leaves at most one of each, but we also handle
+  // non-minimized DFAs.
+  std::vector<bool> dead(num_states, false);
+  std::vector<bool> match(num_states, false);
+  bool has_match_state = false;
+  for (int32_t state = 0; state < num_states; ++state) {
+    bool dead_state = !final_states_[state];
+    bool match_state = final_states_[state];
+    for (int c = 0; c < num_classes_; ++c) {
+      auto const transition = row(state)[c];
+      dead_state &= transition < 0 || transition == state;
+      match_state &= transition == state;
+    }
+    dead[state] = dead_state;
+    match[state] = match_state;
+    has_match_state |= match_state;
+  }
+
+  // Number the rows: the dead state comes first, then the match state if there is one, then the
+  // other accepting states, then all other states.
+  int const special_states = has_match_state ? 2 : 1;
+  uint32_t const match_row = num_classes_;
+  std::vector<uint32_t> rows(num_states);
+  uint32_t next_row = special_states * num_classes_;
+  int accepting_states_end = special_states;
+  for (bool const accepting : {true, false}) {
+    for (int32_t state = 0; state < num_states; ++state) {
+      if (dead[state]) {
+        rows[state] = 0;
+      } else if (match[state]) {
+        rows[state] = match_row;
+      } else if (final_states_[state] == accepting) {
+        rows[state] = next_row;
+        next_row += num_classes_;
+      }
+    }
+    if (accepting) {
+      accepting_states_end = next_row / num_classes_;
+    }
   }
-  if (final_state_ == old_name) {
-    final_state_ = new_name;
+
+  // Pick the narrowest state id type that can hold the offset of the last row.
+  uint32_t const last_row = next_row - num_classes_;
+  if (last_row <= std::numeric_limits<uint8_t>::max()) {
+    return MakeDFA<uint8_t>(rows, next_row, special_states, accepting_states_end, resource);
+  } else if (last_row <= std::numeric_limits<uint16_t>::max()) {
+    return MakeDFA<uint16_t>(rows, next_row, special_states, accepting_states_end, resource);
+  } else {
+    return MakeDFA<uint32_t>(rows, next_row, special_states, accepting_states_end, resource);
   }
 }
 
-void TempNFA::RenameAllStates(int32_t *const next_state) {
-  absl::flat_hash_map<int32_t, int32_t> state_map;
-  for (auto &[state, edges] : states_) {
-    state_map.try_emplace(state, (*next_state)++);
+template <typename StateId>
+std::unique_ptr<AutomatonInterface> TempDFA::MakeDFA(
+    std::vector<uint32_t> const &rows, uint32_t const num_rows, int const special_states,
+    int const accepting_states_end, std::pmr::memory_resource *const resource) const {
+  using Automaton = DFA<StateId>;
+  typename Automaton::States states(num_rows, Automaton::kDeadState, resource);
+  if (special_states > 1) {
+    StateId const match_row = num_classes_;
+    std::fill(states.begin() + match_row, states.begin() + 2 * match_row, match_row);
   }
-  state_map.try_emplace(initial_state_, (*next_state)++);
-  state_map.try_emplace(final_state_, (*next_state)++);
-  absl::btree_map<int32_t, State> new_states;
-  for (auto &[state, edges] : states_) {
-    for (auto &edge : edges) {
-      for (auto &transition : edge) {
-        transition = state_map[transition];
+  for (int32_t state = 0; state < final_states_.size(); ++state) {
+    if (rows[state] < special_states * num_classes_) {
+      continue;
+    }
+    for (int c = 0; c < num_classes_; ++c) {
+      auto const transition = states_[state * num_classes_ + c];
+      states[rows[state] + c] = transition < 0 ? Automaton::kDeadState : rows[transition];
+    }
+  }
+  return std::make_unique<Automaton>(byte_classes_, num_classes_, std::move(states),
+                                     rows[initial_state_], special_states, accepting_states_end);
+}
+
+std::optional<TempNFA::Engine> TempNFA::force_engine_for_testing = std::nullopt;
+
+TempNFA::TempNFA(States states, int32_t const initial_state, int32_t const final_state,
+                 std::vector<Counter> counters)
+    : states_(std::move(states)),
+      parents_(states_.size(), states_.get_allocator()),
+      counters_(std::move(counters)),
+      initial_state_(initial_state),
+      final_state_(final_state) {
+  std::iota(parents_.begin(), parents_.end(), 0);
+}
+
+bool TempNFA::IsDeterministic() const {
+  for (auto const &state : states_) {
+    auto const &edges = state.edges;
+    if (state.epsilon_moves.size() > 1 || (!state.epsilon_moves.empty() && !edges.empty())) {
+      return false;
+    }
+    // The edges are sorted by their first character, so an edge overlaps one of the previous ones
+    // iff it starts before the end of all of them.
+    int last = -1;
+    for (auto const &edge : edges) {
+      if (edge.first <= last) {
+        return false;
       }
+      last = std::max<int>(last, edge.last);
     }
-    new_states.try_emplace(state_map[state], std::move(edges));
   }
-  states_ = std::move(new_states);
-  initial_state_ = state_map[initial_state_];
-  final_state_ = state_map[final_state_];
+  return true;
 }
 
-void TempNFA::AddEdge(uint8_t const label, int const from, int const to) {
-  states_[from][label].emplace_back(to);
+void TempNFA::RenameState(int32_t const old_name, int32_t const new_name) {
+  auto const old_root = FindState(old_name);
+  auto const new_root = FindState(new_name);
+  parents_[old_root] = new_root;
+}
+
+void TempNFA::AddEpsilonMove(int32_t const from, int32_t const to) {
+  auto &epsilon_moves = states_[from].epsilon_moves;
+  auto const it = std::lower_bound(epsilon_moves.begin(), epsilon_moves.end(), to);
+  if (it == epsilon_moves.end() || *it != to) {
+    epsilon_moves.insert(it, to);
+  }
 }
 
 void TempNFA::Chain(TempNFA other) {
-  for (auto &[state, edges] : other.states_) {
-    MergeState(state, std::move(edges));
+  int32_t const final_state = other.final_state_ + states_.size();
+  AddEpsilonMove(final_state_, AppendStates(std::move(other)));
+  final_state_ = final_state;
+}
+
+void TempNFA::Repeat(int const min, int const max) {
+  ApplyRenames();
+  int const num_copies = max < 0 ? std::max(min, 1) : max;
+  if (num_copies == 0) {
+    *this = TempNFA(resource());
+    return;
+  }
+  int32_t const piece_size = states_.size();
+  auto const copy_initial_state = [&](int const copy) {
+    return copy * piece_size + initial_state_;
+  };
+  auto const copy_final_state = [&](int const copy) { return copy * piece_size + final_state_; };
+  States piece = std::move(states_);
+  states_.clear();
+  states_.reserve(num_copies * piece_size + 2);
+  std::vector<Counter> piece_counters = std::move(counters_);
+  counters_.clear();
+  counters_.reserve(num_copies * piece_counters.size());
+  for (int copy = 0; copy < num_copies; ++copy) {
+    int32_t const offset = copy * piece_size;
+    for (auto const &state : piece) {
+      // Shifting all targets by the same amount keeps both lists sorted.
+      auto &new_state = states_.emplace_back(state);
+      for (auto &target : new_state.epsilon_moves) {
+        target += offset;
+      }
+      for (auto &edge : new_state.edges) {
+        edge.target += offset;
+      }
+    }
+    for (auto const &counter : piece_counters) {
+      counters_.push_back(
+          {counter.state + offset, counter.min, counter.max, counter.exit_state + offset});
+    }
+  }
+  for (int copy = 1; copy < num_copies; ++copy) {
+    AddEpsilonMove(copy_final_state(copy - 1), copy_initial_state(copy));
+  }
+  int32_t initial_state = copy_initial_state(0);
+  int32_t final_state;
+  if (max < 0) {
+    // The last copy loops through an extra state, which is final. It's also initial if all copies
+    // are optional.
+    int32_t const loop_state = states_.size();
+    states_.emplace_back();
+    AddEpsilonMove(copy_final_state(num_copies - 1), loop_state);
+    AddEpsilonMove(loop_state, copy_initial_state(num_copies - 1));
+    if (min == 0) {
+      initial_state = loop_state;
+    }
+    final_state = loop_state;
+  } else {
+    // Every optional copy can be skipped by jumping from the end of the previous one to an extra
+    // final state. If the first copy is optional too, another extra state is the initial one.
+    final_state = states_.size();
+    states_.emplace_back();
+    AddEpsilonMove(copy_final_state(num_copies - 1), final_state);
+    for (int copy = std::max(min, 1); copy < num_copies; ++copy) {
+      AddEpsilonMove(copy_final_state(copy - 1), final_state);
+    }
+    if (min == 0) {
+      initial_state = states_.size();
+      states_.emplace_back();
+      AddEpsilonMove(initial_state, copy_initial_state(0));
+      AddEpsilonMove(initial_state, final_state);
+    }
   }
-  AddEdge(0, final_state_, other.initial_state_);
-  final_state_ = other.final_state_;
+  parents_.resize(states_.size());
+  std::iota(parents_.begin(), parents_.end(), 0);
+  initial_state_ = initial_state;
+  final_state_ = final_state;
 }
 
-void TempNFA::Merge(TempNFA &&other, int const initial_state, int const final_state) {
-  for (auto &[state, edges] : other.states_) {
-    MergeState(state, std::move(edges));
+void TempNFA::RepeatWithCounter(int const min, int const max) {
+  // The initial state enters the counting state, which loops on the same characters.
+  State state = std::move(states_[initial_state_]);
+  for (auto &edge : state.edges) {
+    edge.target = 1;
+  }
+  states_.clear();
+  states_.push_back(state);
+  states_.push_back(std::move(state));
+  states_.emplace_back();
+  parents_ = {0, 1, 2};
+  initial_state_ = 0;
+  final_state_ = 2;
+  counters_ = {{1, std::max(min, 1), max, 2}};
+  if (min == 0) {
+    // The initial state has no inbound edges and the final state has no outbound edges, so it's
+    // safe to connect them directly.
+    AddEpsilonMove(initial_state_, final_state_);
   }
-  states_.try_emplace(initial_state, MakeState({{0, {initial_state_, other.initial_state_}}}));
-  states_.try_emplace(final_state, MakeState({}));
-  AddEdge(0, final_state_, final_state);
-  AddEdge(0, other.final_state_, final_state);
+}
+
+void TempNFA::Merge(TempNFA &&other) {
+  int32_t const other_final_state = other.final_state_ + states_.size();
+  int32_t const other_initial_state = AppendStates(std::move(other));
+  int32_t const initial_state = states_.size();
+  int32_t const final_state = initial_state + 1;
+  states_.emplace_back();
+  states_.emplace_back();
+  parents_.push_back(initial_state);
+  parents_.push_back(final_state);
+  AddEpsilonMove(initial_state, initial_state_);
+  AddEpsilonMove(initial_state, other_initial_state);
+  AddEpsilonMove(final_state_, final_state);
+  AddEpsilonMove(other_final_state, final_state);
   initial_state_ = initial_state;
   final_state_ = final_state;
 }
 
-std::unique_ptr<AutomatonInterface> TempNFA::Finalize() && {
+void TempNFA::AllowAnyPrefix() {
+  int32_t const initial_state = states_.size();
+  states_.emplace_back().edges.push_back({0, 255, initial_state});
+  parents_.push_back(initial_state);
+  AddEpsilonMove(initial_state, initial_state_);
+  initial_state_ = initial_state;
+}
+
+void TempNFA::Reverse() {
+  ApplyRenames();
+  // `counter_index[s]` is the index of the counter whose counting state is `s`, or -1.
+  std::vector<int> counter_index(states_.size(), -1);
+  for (int i = 0; i < counters_.size(); ++i) {
+    counter_index[counters_[i].state] = i;
+  }
+  States reversed(states_.size(), resource());
+  // `entering[i]` lists the states with edges into the counting state of `counters_[i]`.
+  std::vector<std::vector<int32_t>> entering(counters_.size());
+  for (int32_t state = 0; state < states_.size(); ++state) {
+    for (auto const target : states_[state].epsilon_moves) {
+      reversed[target].epsilon_moves.push_back(state);
+    }
+    for (auto const &edge : states_[state].edges) {
+      if (counter_index[edge.target] >= 0 && edge.target != state) {
+        entering[counter_index[edge.target]].push_back(state);
+      } else {
+        reversed[edge.target].edges.push_back({edge.first, edge.last, state});
+      }
+    }
+  }
+  for (int i = 0; i < counters_.size(); ++i) {
+    auto &counter = counters_[i];
+    int32_t const exit_state = reversed.size();
+    reversed.emplace_back().epsilon_moves.assign(entering[i].begin(), entering[i].end());
+    for (auto const &edge : states_[counter.state].edges) {
+      reversed[counter.exit_state].edges.push_back({edge.first, edge.last, counter.state});
+    }
+    counter.exit_state = exit_state;
+  }
+  for (auto &state : reversed) {
+    SortAndDeduplicate(&state.epsilon_moves);
+    SortAndDeduplicate(&state.edges);
+  }
+  states_ = std::move(reversed);
+  parents_.resize(states_.size());
+  std::iota(parents_.begin(), parents_.end(), 0);
+  std::swap(initial_state_, final_state_);
+}
+
+std::unique_ptr<AutomatonInterface> TempNFA::Finalize(Flags const &flags,
+                                                      std::pmr::memory_resource *const resource,
+                                                      bool *const prefix_free) && {
+  return std::move(*this).FinalizeImpl(flags, resource, prefix_free, /*require_dfa=*/false);
+}
+
+std::unique_ptr<AutomatonInterface> TempNFA::FinalizeIfDeterminizable(
+    Flags const &flags, std::pmr::memory_resource *const resource, bool *const prefix_free) && {
+  return std::move(*this).FinalizeImpl(flags, resource, prefix_free, /*require_dfa=*/true);
+}
+
+std::unique_ptr<AutomatonInterface> TempNFA::FinalizeImpl(Flags const &flags,
+                                                          std::pmr::memory_resource *const resource,
+                                                          bool *const prefix_free,
+                                                          bool const require_dfa) && {
+  if (prefix_free) {
+    *prefix_free = false;
+  }
+  if (require_dfa && !counters_.empty()) {
+    return nullptr;
+  }
   CollapseEpsilonMoves();
-  if (IsDeterministic()) {
-    return std::make_unique<DFA>(std::move(*this).ToDFA());
+  if (!counters_.empty()) {
+    // The other engines would take the loops of the counting states as unbounded repetitions.
+    auto counters = std::move(counters_);
+    return std::make_unique<CountingNFA>(std::move(*this).ToNFA(resource), counters);
+  }
+  auto const engine = force_engine_for_testing.value_or(Engine::kDFA);
+  auto const byte_classes = ComputeByteClasses();
+  size_t const row_size = GetClassRepresentatives(byte_classes).size() * sizeof(int32_t);
+  size_t const max_dfa_states = flags.max_dfa_bytes / row_size;
+  std::optional<TempDFA> maybe_dfa;
+  if (engine == Engine::kDFA && IsDeterministic()) {
+    // The DFA has no more states than the pattern has positions, so its size is only checked when
+    // there's an alternative.
+    if (!require_dfa || states_.size() <= max_dfa_states) {
+      maybe_dfa = std::move(*this).ToDFA(byte_classes);
+    }
+  } else if (engine == Engine::kDFA || prefix_free || require_dfa) {
+    // When another engine is forced the DFA is still built to check prefix-freeness and whether it
+    // fits, so that the result doesn't depend on the engine.
+    maybe_dfa = Determinize(byte_classes, max_dfa_states, flags.max_determinization_bytes);
+  }
+  if (maybe_dfa.has_value()) {
+    if (prefix_free) {
+      *prefix_free = maybe_dfa->IsPrefixFree();
+    }
+    if (engine == Engine::kDFA) {
+      if (maybe_dfa->num_states() <= flags.max_minimized_dfa_states) {
+        maybe_dfa = maybe_dfa->Minimize();
+      }
+      return maybe_dfa->ToDFA(resource);
+    }
+  }
+  if (require_dfa && !maybe_dfa.has_value()) {
+    return nullptr;
+  }
+  auto nfa = std::move(*this).ToNFA(resource);
+  if (engine == Engine::kDFA || engine == Engine::kShiftAnd) {
+    auto shift_and = MakeShiftAnd(nfa, flags.max_shift_and_positions);
+    if (shift_and) {
+      return shift_and;
+    }
+  }
+  if (engine == Engine::kNFA || flags.lazy_dfa_cache_bytes == 0) {
+    return std::make_unique<NFA>(std::move(nfa));
   } else {
-    return std::make_unique<NFA>(std::move(*this).ToNFA());
+    return std::make_unique<LazyDFA>(std::move(nfa), byte_classes, flags.lazy_dfa_cache_bytes);
   }
 }
 
-void TempNFA::MergeState(int const state, State &&edges) {
-  auto const [it, inserted] = states_.try_emplace(state, std::move(edges));
-  if (!inserted) {
-    for (int ch = 0; ch < 256; ++ch) {
-      auto &edge1 = it->second[ch];
-      auto const &edge2 = edges[ch];
-      edge1.insert(edge1.end(), edge2.begin(), edge2.end());
+int32_t TempNFA::AppendStates(TempNFA &&other) {
+  int32_t const offset = states_.size();
+  states_.reserve(states_.size() + other.states_.size());
+  parents_.reserve(parents_.size() + other.parents_.size());
+  for (auto &state : other.states_) {
+    // Shifting all targets by the same amount keeps both lists sorted.
+    for (auto &target : state.epsilon_moves) {
+      target += offset;
+    }
+    for (auto &edge : state.edges) {
+      edge.target += offset;
     }
+    states_.push_back(std::move(state));
+  }
+  for (auto const parent : other.parents_) {
+    parents_.push_back(parent + offset);
   }
+  for (auto const &counter : other.counters_) {
+    counters_.push_back(
+        {counter.state + offset, counter.min, counter.max, counter.exit_state + offset});
+  }
+  return other.initial_state_ + offset;
 }
 
-bool TempNFA::HasOnlyOneEpsilonMove(int const state) const {
-  auto const &edges = states_.find(state)->second;
-  if (edges[0].size() != 1) {
-    return false;
+int32_t TempNFA::FindState(int32_t state) {
+  // Path halving: make every other state on the path point to its grandparent.
+  while (parents_[state] != state) {
+    parents_[state] = parents_[parents_[state]];
+    state = parents_[state];
   }
-  for (int ch = 1; ch < 256; ++ch) {
-    if (!edges[ch].empty()) {
-      return false;
+  return state;
+}
+
+void TempNFA::ApplyRenames() {
+  std::pmr::vector<int32_t> new_names(states_.size(), -1, resource());
+  int32_t num_states = 0;
+  for (int32_t state = 0; state < states_.size(); ++state) {
+    auto const root = FindState(state);
+    if (new_names[root] < 0) {
+      new_names[root] = num_states++;
     }
   }
-  return true;
+  States new_states(num_states, resource());
+  for (int32_t state = 0; state < states_.size(); ++state) {
+    auto const name = new_names[FindState(state)];
+    auto &new_state = new_states[name];
+    for (auto const target : states_[state].epsilon_moves) {
+      auto const new_target = new_names[FindState(target)];
+      if (new_target != name) {
+        new_state.epsilon_moves.push_back(new_target);
+      }
+    }
+    for (auto const &edge : states_[state].edges) {
+      new_state.edges.push_back({edge.first, edge.last, new_names[FindState(edge.target)]});
+    }
+  }
+  for (auto &state : new_states) {
+    SortAndDeduplicate(&state.epsilon_moves);
+    SortAndDeduplicate(&state.edges);
+  }
+  initial_state_ = new_names[FindState(initial_state_)];
+  final_state_ = new_names[FindState(final_state_)];
+  for (auto &counter : counters_) {
+    counter.state = new_names[FindState(counter.state)];
+    counter.exit_state = new_names[FindState(counter.exit_state)];
+  }
+  states_ = std::move(new_states);
+  parents_.resize(num_states);
+  std::iota(parents_.begin(), parents_.end(), 0);
 }
 
-bool TempNFA::CollapseNextEpsilonMove() {
-  for (auto &[state, edges] : states_) {
-    if (HasOnlyOneEpsilonMove(state)) {
-      int const destination = edges[0][0];
-      if (state == destination || state != final_state_) {
-        edges[0].clear();
-        RenameState(destination, state);
-        return true;
+void TempNFA::CollapseEpsilonMoves() {
+  ApplyRenames();
+  bool collapsed = true;
+  while (collapsed) {
+    collapsed = false;
+    for (int32_t state = 0; state < states_.size(); ++state) {
+      auto const &epsilon_moves = states_[state].epsilon_moves;
+      // `ApplyRenames` dropped all epsilon-moves from a state to itself, so the target is a
+      // different state.
+      if (state != final_state_ && states_[state].edges.empty() && epsilon_moves.size() == 1) {
+        RenameState(state, epsilon_moves[0]);
+        collapsed = true;
       }
     }
+    if (collapsed) {
+      ApplyRenames();
+    }
   }
-  return false;
 }
 
-void TempNFA::CollapseEpsilonMoves() {
-  while (CollapseNextEpsilonMove()) {
-    // nothing to do.
-  }
-}
-
-DFA TempNFA::ToDFA() && {
-  absl::flat_hash_map<int32_t, int32_t> state_map;
-  DFA::States dfa_states;
-  dfa_states.reserve(states_.size());
-  int i = 0;
-  for (auto &[state, edges] : states_) {
-    state_map.try_emplace(state, i++);
-    DFA::State dfa_state;
-    for (int ch = 0; ch < 256; ++ch) {
-      if (edges[ch].empty()) {
-        dfa_state[ch] = -1;
-      } else {
-        dfa_state[ch] = edges[ch][0];
+TempDFA TempNFA::ToDFA(ByteClasses const &byte_classes) && {
+  int const num_classes = GetClassRepresentatives(byte_classes).size();
+  TempDFA::States dfa_states;
+  dfa_states.reserve(states_.size() * num_classes);
+  std::vector<bool> final_states;
+  final_states.reserve(states_.size());
+  for (int32_t state = 0; state < states_.size(); ++state) {
+    // Follow the chain of epsilon-moves starting at `state`, if any. The DFA state inherits the
+    // edges of the last state in the chain and accepts if any of the states in the chain is final.
+    // Since the automaton is deterministic, states with an epsilon-move have no other edges, and
+    // the chain can only loop if it never reaches a state with labeled edges.
+    State const *last_state = &states_[state];
+    bool is_final = state == final_state_;
+    for (size_t length = 0; !last_state->epsilon_moves.empty() && length < states_.size();
+         ++length) {
+      int32_t const target = last_state->epsilon_moves[0];
+      last_state = &states_[target];
+      is_final |= target == final_state_;
+    }
+    final_states.push_back(is_final);
+    auto const row = dfa_states.size();
+    dfa_states.resize(row + num_classes, -1);
+    for (auto const &edge : last_state->edges) {
+      for (int ch = edge.first; ch <= edge.last; ++ch) {
+        dfa_states[row + byte_classes[ch]] = edge.target;
+      }
+    }
+  }
+  return TempDFA(byte_classes, num_classes, std::move(dfa_states), initial_state_,
+                 std::move(final_states));
+}
+
+TempNFA::StateSet TempNFA::EpsilonClosure(StateSet states, SparseSet *const closure) const {
+  closure->Clear();
+  for (auto const state : states) {
+    closure->Insert(state);
+  }
+  while (!states.empty()) {
+    auto const state = states.back();
+    states.pop_back();
+    for (auto const target : states_[state].epsilon_moves) {
+      if (closure->Insert(target)) {
+        states.push_back(target);
+      }
+    }
+  }
+  StateSet result(closure->begin(), closure->end(), resource());
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+std::optional<TempDFA> TempNFA::Determinize(ByteClasses const &byte_classes,
+                                            size_t const max_states,
+                                            size_t const max_set_bytes) const {
+  int const num_classes = GetClassRepresentatives(byte_classes).size();
+
+  // For every NFA state, list the (class, target) pairs of its edges. Every byte class is either
+  // entirely inside or entirely outside the range of each edge.
+  std::pmr::vector<std::pmr::vector<std::pair<uint8_t, int32_t>>> class_edges(states_.size(),
+                                                                               resource());
+  for (int32_t state = 0; state < states_.size(); ++state) {
+    auto &state_class_edges = class_edges[state];
+    for (auto const &edge : states_[state].edges) {
+      std::bitset<256> classes;
+      for (int ch = edge.first; ch <= edge.last; ++ch) {
+        if (!classes[byte_classes[ch]]) {
+          classes.set(byte_classes[ch]);
+          state_class_edges.emplace_back(byte_classes[ch], edge.target);
+        }
       }
     }
-    dfa_states.emplace_back(std::move(dfa_state));
   }
-  state_map.try_emplace(initial_state_, i++);
-  state_map.try_emplace(final_state_, i++);
-  for (auto &state : dfa_states) {
-    for (auto &transition : state) {
-      if (transition >= 0) {
-        transition = state_map[transition];
+
+  // Maps every set of NFA states discovered so far to the corresponding DFA state. Sets are sorted
+  // so that each one has a unique representation. `state_map` is a node-based container, so the
+  // pointers in `queue` stay valid while it grows.
+  NodeHashMap<StateSet, int32_t> state_map(resource());
+  std::pmr::vector<StateSet const *> queue(resource());
+  TempDFA::States dfa_states;
+  std::vector<bool> final_states;
+  // Every set is hashed and compared whether or not it's new, so all of them count.
+  size_t set_bytes = 0;
+  auto const get_state = [&](StateSet &&states) {
+    set_bytes += states.size() * sizeof(int32_t);
+    auto const [it, inserted] = state_map.try_emplace(std::move(states), queue.size());
+    if (inserted) {
+      queue.emplace_back(&it->first);
+      dfa_states.insert(dfa_states.end(), num_classes, -1);
+      final_states.push_back(std::binary_search(it->first.begin(), it->first.end(), final_state_));
+    }
+    return it->second;
+  };
+  SparseSet closure{states_.size()};
+  int32_t const initial_state =
+      get_state(EpsilonClosure(StateSet({initial_state_}, resource()), &closure));
+  for (size_t i = 0; i < queue.size(); ++i) {
+    if (queue.size() > max_states || set_bytes > max_set_bytes) {
+      return std::nullopt;
+    }
+    std::pmr::vector<StateSet> next_states(num_classes, resource());
+    for (auto const state : *queue[i]) {
+      for (auto const &[byte_class, target] : class_edges[state]) {
+        next_states[byte_class].push_back(target);
+      }
+    }
+    for (int c = 0; c < num_classes; ++c) {
+      if (!next_states[c].empty()) {
+        dfa_states[i * num_classes + c] =
+            get_state(EpsilonClosure(std::move(next_states[c]), &closure));
       }
     }
   }
-  return DFA(std::move(dfa_states), state_map[initial_state_], state_map[final_state_]);
+  if (queue.size() > max_states || set_bytes > max_set_bytes) {
+    return std::nullopt;
+  }
+  return TempDFA(byte_classes, num_classes, std::move(dfa_states), initial_state,
+                 std::move(final_states));
 }
 
-NFA TempNFA::ToNFA() && {
-  absl::flat_hash_map<int32_t, int32_t> state_map;
-  NFA::States nfa_states;
-  nfa_states.reserve(states_.size());
-  int i = 0;
-  for (auto &[state, edges] : states_) {
-    state_map.try_emplace(state, i++);
-    nfa_states.emplace_back(std::move(edges));
+ByteClasses TempNFA::ComputeByteClasses() const {
+  // Start with all characters in class 0, then split classes state by state so that in the end two
+  // characters are in the same class only if every state has the same edges for both.
+  ByteClasses byte_classes;
+  byte_classes.fill(0);
+  std::pmr::vector<int> boundaries(resource());
+  StateSet targets(resource());
+  // The maps are cleared for every state but keep their capacity.
+  FlatHashMap<StateSet, int> target_sets(resource());
+  FlatHashMap<std::pair<uint8_t, int>, uint8_t> new_classes(resource());
+  for (auto const &state : states_) {
+    auto const &edges = state.edges;
+    // The boundaries of the edge ranges split the characters into segments such that all the
+    // characters of a segment have the same targets in this state.
+    boundaries.assign({0, 256});
+    for (auto const &edge : edges) {
+      boundaries.push_back(edge.first);
+      boundaries.push_back(edge.last + 1);
+    }
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+    target_sets.clear();
+    new_classes.clear();
+    for (size_t i = 0; i + 1 < boundaries.size(); ++i) {
+      targets.clear();
+      for (auto const &edge : edges) {
+        if (edge.first <= boundaries[i] && boundaries[i] <= edge.last) {
+          targets.push_back(edge.target);
+        }
+      }
+      auto const target_set = target_sets.try_emplace(targets, target_sets.size()).first->second;
+      for (int ch = boundaries[i]; ch < boundaries[i + 1]; ++ch) {
+        auto const [it, inserted] = new_classes.try_emplace(
+            std::make_pair(byte_classes[ch], target_set), new_classes.size());
+        byte_classes[ch] = it->second;
+      }
+    }
   }
-  state_map.try_emplace(initial_state_, i++);
-  state_map.try_emplace(final_state_, i++);
-  for (auto &state : nfa_states) {
-    for (auto &edge : state) {
-      for (auto &transition : edge) {
-        transition = state_map[transition];
+  return byte_classes;
+}
+
+NFA TempNFA::ToNFA(std::pmr::memory_resource *const resource) && {
+  std::pmr::vector<uint32_t> edge_offsets(resource);
+  edge_offsets.reserve(states_.size() + 1);
+  edge_offsets.push_back(0);
+  std::pmr::vector<NFA::Edge> nfa_edges(resource);
+  std::pmr::vector<int32_t> targets(resource);
+  // The epsilon-moves are only needed to compute the epsilon-closures, so they're allocated from
+  // the default resource.
+  std::vector<uint32_t> epsilon_offsets;
+  epsilon_offsets.reserve(states_.size() + 1);
+  epsilon_offsets.push_back(0);
+  std::vector<int32_t> epsilon_targets;
+  std::vector<int> boundaries;
+  std::vector<int32_t> segment_targets;
+  for (auto const &state : states_) {
+    auto const &edges = state.edges;
+    epsilon_targets.insert(epsilon_targets.end(), state.epsilon_moves.begin(),
+                           state.epsilon_moves.end());
+    epsilon_offsets.push_back(epsilon_targets.size());
+    // Split the ranges at all their boundaries so that the edges of the NFA state don't overlap,
+    // then merge adjacent segments with the same targets.
+    boundaries.clear();
+    for (auto const &edge : edges) {
+      boundaries.push_back(edge.first);
+      boundaries.push_back(edge.last + 1);
+    }
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+    size_t const first_edge = nfa_edges.size();
+    for (size_t j = 0; j + 1 < boundaries.size(); ++j) {
+      segment_targets.clear();
+      for (auto const &edge : edges) {
+        if (edge.first <= boundaries[j] && boundaries[j] <= edge.last) {
+          segment_targets.push_back(edge.target);
+        }
+      }
+      if (segment_targets.empty()) {
+        continue;
+      }
+      std::sort(segment_targets.begin(), segment_targets.end());
+      segment_targets.erase(std::unique(segment_targets.begin(), segment_targets.end()),
+                            segment_targets.end());
+      uint8_t const first = boundaries[j];
+      uint8_t const last = boundaries[j + 1] - 1;
+      if (nfa_edges.size() > first_edge) {
+        auto &previous = nfa_edges.back();
+        if (previous.last + 1 == first &&
+            std::equal(targets.begin() + previous.targets_begin, targets.end(),
+                       segment_targets.begin(), segment_targets.end())) {
+          previous.last = last;
+          continue;
+        }
       }
+      uint32_t const offset = targets.size();
+      targets.insert(targets.end(), segment_targets.begin(), segment_targets.end());
+      nfa_edges.push_back({first, last, offset, static_cast<uint32_t>(targets.size())});
     }
+    edge_offsets.push_back(nfa_edges.size());
   }
-  return NFA(std::move(nfa_states), state_map[initial_state_], state_map[final_state_]);
+  return NFA(std::move(edge_offsets), std::move(nfa_edges), std::move(targets), epsilon_offsets,
+             epsilon_targets, initial_state_, final_state_);
 }
 
 }  // namespace re3
@@ -1,115 +1,340 @@
 #ifndef __RE3_LIB_TEMP_H__
 #define __RE3_LIB_TEMP_H__
 
+#include <bitset>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <tuple>
 #include <utility>
+#include <vector>
 
-#include "absl/container/btree_map.h"
-#include "absl/container/flat_hash_map.h"
-#include "absl/container/inlined_vector.h"
 #include "lib/automaton.h"
+#include "lib/counting_nfa.h"
 #include "lib/dfa.h"
+#include "lib/flags.h"
 #include "lib/nfa.h"
+#include "lib/sparse_set.h"
 
 namespace re3 {
 
-using State = NFA::State;
+// An edge of a `TempNFA`, labeled with all the characters in the range `[first, last]`.
+struct Edge {
+  uint8_t first;
+  uint8_t last;
+  int32_t target;
 
-// Convenience function to build an NFA `State` without listing all 256 input characters.
-//
-// Example:
+  friend bool operator==(Edge const &lhs, Edge const &rhs) {
+    return std::tie(lhs.first, lhs.last, lhs.target) == std::tie(rhs.first, rhs.last, rhs.target);
+  }
+
+  friend bool operator<(Edge const &lhs, Edge const &rhs) {
+    return std::tie(lhs.first, lhs.last, lhs.target) < std::tie(rhs.first, rhs.last, rhs.target);
+  }
+};
+
+// The outbound edges of a `TempNFA` state. Epsilon-moves are kept apart from the edges labeled with
+// characters, so every byte (including 0) can label an edge. Both lists are sorted and without
+// duplicates.
 //
-//   // Build a State accepting characters 'a' and 'f'.
-//   MakeState({
-//     {'a', {12, 3}},
-//     {'f', {4, 56, 7}},
-//   })
+// `State` is allocator-aware: the states in a `TempNFA::States` allocate their lists from the same
+// memory resource as the container.
+struct State {
+  using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+
+  State() = default;
+
+  explicit State(allocator_type const &allocator) : epsilon_moves(allocator), edges(allocator) {}
+
+  State(State const &other, allocator_type const &allocator)
+      : epsilon_moves(other.epsilon_moves, allocator), edges(other.edges, allocator) {}
+
+  State(State &&other, allocator_type const &allocator)
+      : epsilon_moves(std::move(other.epsilon_moves), allocator),
+        edges(std::move(other.edges), allocator) {}
+
+  State(State const &) = default;
+  State &operator=(State const &) = default;
+  State(State &&) noexcept = default;
+  State &operator=(State &&) noexcept = default;
+
+  // The targets of the epsilon-moves.
+  std::pmr::vector<int32_t> epsilon_moves;
+
+  std::pmr::vector<Edge> edges;
+};
+
+// Builds a `State` with edges to `target` labeled with all the characters in `chars`. Consecutive
+// characters are merged into ranges, so the state has one edge per run of characters.
+State MakeState(std::bitset<256> const &chars, int32_t target,
+                std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+// Represents a DFA under construction.
 //
-State MakeState(absl::flat_hash_map<uint8_t, absl::InlinedVector<int32_t, 1>> &&edges);
+// `TempNFA` generates a `TempDFA` when it can be determinized. `TempDFA` uses a plain
+// representation that's easy to manipulate (e.g. to minimize it) and is then converted to a `DFA`,
+// whose representation is optimized for running it.
+class TempDFA {
+ public:
+  // The transition table has one row per state and one column per byte class. Each transition is
+  // an integer representing the next state, or a negative value if that edge doesn't exist. The
+  // transition from state `s` on class `c` is at index `s * num_classes + c`.
+  using States = std::vector<int32_t>;
+
+  // `final_states` flags the accepting states, it must have one element per row of `states`.
+  explicit TempDFA(ByteClasses const &byte_classes, int const num_classes, States states,
+                   int32_t const initial_state, std::vector<bool> final_states)
+      : byte_classes_(byte_classes),
+        num_classes_(num_classes),
+        states_(std::move(states)),
+        initial_state_(initial_state),
+        final_states_(std::move(final_states)) {}
+
+  TempDFA(TempDFA const &) = default;
+  TempDFA &operator=(TempDFA const &) = default;
+  TempDFA(TempDFA &&) noexcept = default;
+  TempDFA &operator=(TempDFA &&) noexcept = default;
+
+  size_t num_states() const { return final_states_.size(); }
+
+  // Returns an equivalent DFA with the minimum number of states, computed with Hopcroft's partition
+  // refinement algorithm.
+  TempDFA Minimize() const;
+
+  // Checks if no accepting state can be reached from an accepting state by reading one or more
+  // characters, which means that the language is prefix-free if all states are reachable.
+  bool IsPrefixFree() const;
+
+  // Converts this automaton to the optimized representation of `DFA`, using the narrowest state id
+  // type that fits. The tables of the `DFA` are allocated from `resource`.
+  std::unique_ptr<AutomatonInterface> ToDFA(std::pmr::memory_resource *resource) const;
+
+ private:
+  // Builds a `DFA` with the provided state id type. `rows` maps every state to the offset of its
+  // row in the transition table, which has `num_rows` rows, the first `special_states` of which are
+  // reserved as described in `DFA`. The rows of the other accepting states come next, up to row
+  // `accepting_states_end`.
+  template <typename StateId>
+  std::unique_ptr<AutomatonInterface> MakeDFA(std::vector<uint32_t> const &rows, uint32_t num_rows,
+                                              int special_states, int accepting_states_end,
+                                              std::pmr::memory_resource *resource) const;
+
+  ByteClasses byte_classes_;
+  int num_classes_;
+  States states_;
+  int32_t initial_state_;
+  std::vector<bool> final_states_;
+};
 
 // Represents an NFA under construction.
 //
+// States are numbered densely starting from 0 and their edges are stored in a vector indexed by
+// state number, so combining two automata only takes shifting the state numbers of one of them.
+// Renames are recorded in a union-find structure and applied all at once by `ApplyRenames()`, which
+// merges every group of states renamed into each other in a single pass.
+//
+// The states, their edges, and all the scratch space used to finalize the automaton are allocated
+// from the memory resource of `States`, which is typically the arena of the `Parser`. The resource
+// must outlive the automaton, and all automata combined with each other must use the same one.
+//
 // `TempNFA` is used by the `Parser` to perform various manipulations during construction.
 class TempNFA {
  public:
-  using States = absl::btree_map<int32_t, State>;
+  // The edges of every state, indexed by state number.
+  using States = std::pmr::vector<State>;
+
+  using Counter = CountingNFA::Counter;
+
+  // The kinds of automata `Finalize()` can generate.
+  enum class Engine {
+    kDFA,
+    kShiftAnd,
+    kLazyDFA,
+    kNFA,
+  };
+
+  // TESTS ONLY: force `Finalize()` to generate the specified kind of automaton even if a faster one
+  // is available. Defaults to `std::nullopt`, in which case `Finalize()` picks the fastest.
+  static std::optional<Engine> force_engine_for_testing;
 
-  // TESTS ONLY: force `Finalize()` to always generate an NFA even if it's deterministic. Defaults
-  // to false.
-  static bool force_nfa_for_testing;
+  // Builds an automaton with only one state, which is both initial and final. It accepts only the
+  // empty string.
+  explicit TempNFA(std::pmr::memory_resource *const resource = std::pmr::get_default_resource())
+      : TempNFA(States(1, resource), 0, 0) {}
 
-  explicit TempNFA() = default;
+  // All edge targets, `initial_state`, and `final_state` must be valid indices in `states`, and so
+  // must the states of `counters`. The lists of every state must be sorted and without duplicates.
+  explicit TempNFA(States states, int32_t initial_state, int32_t final_state,
+                   std::vector<Counter> counters = {});
 
-  explicit TempNFA(States states, int const initial_state, int const final_state)
-      : states_(std::move(states)), initial_state_(initial_state), final_state_(final_state) {}
+  // Copies allocate from the same memory resource as `other`.
+  TempNFA(TempNFA const &other)
+      : states_(other.states_, other.states_.get_allocator()),
+        parents_(other.parents_, other.parents_.get_allocator()),
+        counters_(other.counters_),
+        initial_state_(other.initial_state_),
+        final_state_(other.final_state_) {}
 
-  TempNFA(TempNFA const &) = default;
   TempNFA &operator=(TempNFA const &) = default;
   TempNFA(TempNFA &&) noexcept = default;
   TempNFA &operator=(TempNFA &&) noexcept = default;
 
-  int initial_state() const { return initial_state_; }
-  int final_state() const { return final_state_; }
+  size_t num_states() const { return states_.size(); }
+  int32_t initial_state() const { return initial_state_; }
+  int32_t final_state() const { return final_state_; }
 
   // Checks if the automaton is deterministic (that is, for each state each label is at most on one
   // edge and either there's no epsilon-move or the epsilon-move is the only one).
+  //
+  // REQUIRES: there must be no pending renames (see `ApplyRenames`).
   bool IsDeterministic() const;
 
-  // Renames state `old_name` to `new_name`.
-  void RenameState(int old_name, int new_name);
-
-  // Renames all states of this NFA so that they are greater than or equal to `next_state`. The
-  // `next_state` variable is incremented accordingly.
-  void RenameAllStates(int32_t *next_state);
+  // Renames state `old_name` to `new_name`, merging the two states. The rename is only recorded
+  // here and takes effect at the next call to `ApplyRenames()`; until then both names remain valid
+  // and refer to the same state.
+  void RenameState(int32_t old_name, int32_t new_name);
 
-  // Adds a new edge labeled with character `label` from state `from` to state `to`.
-  void AddEdge(uint8_t label, int from, int to);
+  // Adds an epsilon-move from state `from` to state `to`.
+  void AddEpsilonMove(int32_t from, int32_t to);
 
-  // Chains this NFA with `other` by merging the final state of the former with the initial state of
-  // the latter. The resulting automaton recognizes concatenations of the strings originally
-  // recognized by `this` and those originally recognized by `other`.
+  // Chains this NFA with `other` by adding an epsilon-move from the final state of the former to
+  // the initial state of the latter. The resulting automaton recognizes concatenations of the
+  // strings originally recognized by `this` and those originally recognized by `other`.
   //
-  // WARNING: this method will NOT rename states as necessary to avoid collisions; the caller is
-  // responsible for calling `RenameAllStates` beforehand.
+  // The states of `other` are renumbered to follow those of `this`.
   void Chain(TempNFA other);
 
+  // Replaces this automaton with one that accepts the concatenations of `min` to `max` strings
+  // accepted by the original, or of at least `min` strings if `max` is negative. All copies of the
+  // original states are stamped out in a single pass at precomputed offsets.
+  //
+  // Copies are joined through extra states rather than by epsilon-moves into the initial state or
+  // out of the final state of a copy, which could otherwise be taken in the middle of a copy that
+  // loops through them (e.g. in `(a+b)*`).
+  //
+  // REQUIRES: `min` must not be negative, and `max` must be either negative or at least `min`.
+  void Repeat(int min, int max);
+
+  // Like `Repeat`, but represents the repetition with a single counting state and a counter rather
+  // than stamping out copies, so the size of the automaton doesn't depend on the bounds. Automata
+  // with counters are run by the `CountingNFA`.
+  //
+  // REQUIRES: the automaton must be the one built for a single character class, i.e. an initial
+  // state whose edges all lead to a final state without edges. `min` must not be negative, and
+  // `max` must be either negative or at least `min`.
+  void RepeatWithCounter(int min, int max);
+
   // Merges `other` with this automaton, resulting in a new automaton that accepts both the strings
-  // of the original `this` and those of `other`. `initial_state` and `final_state` must be newly
-  // generated by the caller.
-  void Merge(TempNFA &&other, int initial_state, int final_state);
+  // of the original `this` and those of `other`. The states of `other` are renumbered to follow
+  // those of `this`, and two new states are added to be the initial and final states.
+  void Merge(TempNFA &&other);
+
+  // Makes the automaton skip any prefix of the input before matching, so that it recognizes
+  // `.*(...)`. A new initial state is added, which loops on every character and has an epsilon-move
+  // to the old initial state. Running the result with `PrefixLength::kShortest` finds the earliest
+  // end of a match within the input.
+  void AllowAnyPrefix();
+
+  // Reverses the automaton, so that it recognizes the reversal of every string it recognized. Every
+  // edge and epsilon-move is flipped and the initial and final states are swapped.
+  //
+  // Counters can't be flipped edge by edge, because the counter is started by the edges entering
+  // its counting state and finished by the epsilon-closure of its exit state. In the reversed
+  // automaton the exit state enters the counting state instead, and the counter finishes in a new
+  // state with epsilon-moves to the states that used to enter it. This relies on the edges entering
+  // a counting state being labeled with the same characters as its loops, which is how
+  // `RepeatWithCounter` builds them.
+  void Reverse();
+
+  // Finalizes this automaton by converting it into a `CountingNFA` if it has counters (see
+  // `RepeatWithCounter`). Otherwise, it's converted into a `DFA` object if it's deterministic or if
+  // it can be determinized within the limits specified in `flags`, in which case the DFA is
+  // also minimized if it's small enough. Otherwise the automaton is converted to an `NFA`, which is
+  // run by the bit-parallel `ShiftAnd` engine if it has few enough positions or wrapped in a
+  // `LazyDFA` otherwise, unless `flags` disable the latter.
+  //
+  // If `prefix_free` isn't null, it's set to whether the language of the automaton is prefix-free,
+  // i.e. whether none of the strings it accepts is a proper prefix of another one. The check is
+  // done on the DFA (see `TempDFA::IsPrefixFree`), so it's conservatively false if no DFA is built.
+  //
+  // The tables of the returned automaton are allocated from `resource`, which must outlive it.
+  std::unique_ptr<AutomatonInterface> Finalize(Flags const &flags,
+                                               std::pmr::memory_resource *resource,
+                                               bool *prefix_free = nullptr) &&;
 
-  // Finalizes this automaton by converting it into a `DFA` object if it's deterministic or an `NFA`
-  // if it's not.
-  std::unique_ptr<AutomatonInterface> Finalize() &&;
+  // Like `Finalize`, but returns null if the automaton has counters or if it can't be determinized
+  // within the limits specified in `flags`, regardless of the engine that would run it.
+  std::unique_ptr<AutomatonInterface> FinalizeIfDeterminizable(Flags const &flags,
+                                                               std::pmr::memory_resource *resource,
+                                                               bool *prefix_free = nullptr) &&;
 
  private:
-  // Adds a state and its edges to the NFA, or merges it with an existing one.
-  void MergeState(int state, State &&edges);
+  // Implements `Finalize` and, if `require_dfa` is true, `FinalizeIfDeterminizable`.
+  std::unique_ptr<AutomatonInterface> FinalizeImpl(Flags const &flags,
+                                                   std::pmr::memory_resource *resource,
+                                                   bool *prefix_free, bool require_dfa) &&;
 
-  // Checks whether the given state has exactly one outbound edge towards a single destination
-  // state, and that edge is epsilon-labeled. In that case `CollapseNextEpsilonMove` will collpase
-  // it into the destination state.
-  bool HasOnlyOneEpsilonMove(int state) const;
+  // Appends the states of `other` to those of this automaton, and returns the number the initial
+  // state of `other` was assigned (the numbers of all its states are shifted by the same amount).
+  int32_t AppendStates(TempNFA &&other);
 
-  // Auxiliary method for the implementation of `CollapseEpsilonMoves`.
-  bool CollapseNextEpsilonMove();
+  // Returns the state that `state` was renamed to, following the renames recorded so far.
+  int32_t FindState(int32_t state);
 
-  // Collapses epsilon-moves by merging states that are separated by such a move.
+  // Applies all the renames recorded by `RenameState`. Every group of states renamed into each
+  // other becomes a single state with the union of their edges, epsilon-moves from a state to
+  // itself are dropped, and all states are renumbered densely.
+  void ApplyRenames();
+
+  // Collapses epsilon-moves by merging every non-final state that has no edges other than a single
+  // epsilon-move into the target of that move, which accepts the same strings.
   //
-  // REQUIRES: the automaton must be deterministic, in which case two states separated by an
-  // epsilon-move can't have any other edge in between.
+  // Each pass over the states takes linear time. Merging may leave further states with only one
+  // epsilon-move (e.g. when both targets of a state are merged into one), so passes are repeated
+  // until nothing changes, which normally takes one or two.
   void CollapseEpsilonMoves();
 
-  // Finalizes this NFA by converting it to an `DFA` object, assuming the automaton is deterministic
-  // (`IsDeterministic()` must return true) and has no epsilon-moves (`CollapseEpsilonMoves()` must
-  // have been called).
-  DFA ToDFA() &&;
+  // Partitions the input characters into equivalence classes, such that any two characters in the
+  // same class label the same edges in every state.
+  ByteClasses ComputeByteClasses() const;
+
+  // Converts this NFA to a `TempDFA`, assuming the automaton is deterministic (`IsDeterministic()`
+  // must return true). Any remaining epsilon-moves are resolved so that the resulting DFA has none.
+  // `byte_classes` must have been computed by `ComputeByteClasses()`.
+  TempDFA ToDFA(ByteClasses const &byte_classes) &&;
+
+  // Finalizes this NFA by converting it to an `NFA` object, whose tables are allocated from
+  // `resource`.
+  NFA ToNFA(std::pmr::memory_resource *resource) &&;
 
-  // Finalizes this NFA by converting it to an `NFA` object.
-  NFA ToNFA() &&;
+  // A set of states, sorted and without duplicates.
+  using StateSet = std::pmr::vector<int32_t>;
+
+  std::pmr::memory_resource *resource() const { return states_.get_allocator().resource(); }
+
+  // Returns the set of states that are reachable from `states` through epsilon-moves, including
+  // `states` themselves. `closure` is scratch space and must have a capacity of at least
+  // `num_states()`.
+  StateSet EpsilonClosure(StateSet states, SparseSet *closure) const;
+
+  // Converts this NFA to an equivalent `DFA` using the powerset construction. Returns
+  // `std::nullopt` if the DFA would have more than `max_states` states, or if the sets of NFA
+  // states computed along the way would take more than `max_set_bytes` in total. `byte_classes`
+  // must have been computed by `ComputeByteClasses()`.
+  std::optional<TempDFA> Determinize(ByteClasses const &byte_classes, size_t max_states,
+                                     size_t max_set_bytes) const;
 
   States states_;
+
+  // Union-find forest of the recorded renames: `parents_[i] == i` iff state `i` hasn't been
+  // renamed.
+  std::pmr::vector<int32_t> parents_;
+
+  // Counters of the bounded repetitions built by `RepeatWithCounter`.
+  std::vector<Counter> counters_;
+
   int32_t initial_state_ = 0;
   int32_t final_state_ = 0;
 };
@@ -0,0 +1,54 @@
+#include "lib/thompson.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+#include <utility>
+
+#include "lib/ast.h"
+#include "lib/flags.h"
+#include "lib/temp.h"
+
+namespace re3 {
+
+TempNFA BuildThompsonNFA(ASTNode const &ast, Flags const &flags,
+                         std::pmr::memory_resource *const resource) {
+  switch (ast.kind) {
+    case ASTNode::Kind::kEmpty:
+      return TempNFA(resource);
+    case ASTNode::Kind::kCharacterClass: {
+      TempNFA::States states(resource);
+      states.push_back(MakeState(ast.chars, 1, resource));
+      states.emplace_back();
+      return TempNFA(std::move(states), 0, 1);
+    }
+    case ASTNode::Kind::kConcatenation: {
+      auto nfa = BuildThompsonNFA(*ast.children[0], flags, resource);
+      for (size_t i = 1; i < ast.children.size(); ++i) {
+        nfa.Chain(BuildThompsonNFA(*ast.children[i], flags, resource));
+      }
+      return nfa;
+    }
+    case ASTNode::Kind::kAlternation: {
+      auto nfa = BuildThompsonNFA(*ast.children[0], flags, resource);
+      for (size_t i = 1; i < ast.children.size(); ++i) {
+        nfa.Merge(BuildThompsonNFA(*ast.children[i], flags, resource));
+      }
+      return nfa;
+    }
+    case ASTNode::Kind::kRepetition: {
+      auto const &child = *ast.children[0];
+      auto nfa = BuildThompsonNFA(child, flags, resource);
+      if (std::max(ast.min, ast.max) > flags.max_unrolled_class_repetitions &&
+          child.kind == ASTNode::Kind::kCharacterClass) {
+        nfa.RepeatWithCounter(ast.min, ast.max);
+      } else {
+        nfa.Repeat(ast.min, ast.max);
+      }
+      return nfa;
+    }
+  }
+  return TempNFA(resource);
+}
+
+}  // namespace re3
@@ -0,0 +1,23 @@
+#ifndef __RE3_LIB_THOMPSON_H__
+#define __RE3_LIB_THOMPSON_H__
+
+#include <memory_resource>
+
+#include "lib/ast.h"
+#include "lib/flags.h"
+#include "lib/temp.h"
+
+namespace re3 {
+
+// Builds an automaton recognizing the strings matched by `ast` using Thompson's construction: the
+// automata of the subexpressions are combined with epsilon-moves, which `TempNFA::Finalize`
+// collapses where possible. Large bounded repetitions of a character class are represented with a
+// counter, as specified by `flags`.
+//
+// The states of the automaton are allocated from `resource`.
+TempNFA BuildThompsonNFA(ASTNode const &ast, Flags const &flags,
+                         std::pmr::memory_resource *resource);
+
+}  // namespace re3
+
+#endif  // __RE3_LIB_THOMPSON_H__